@@ -13,6 +13,19 @@ inline int atomic_exch(int32_t old_value, int32_t new_value, volatile int32_t *p
 	return prev != old_value;
 }
 
+inline int32_t atomic_load(const volatile int32_t *ptr)
+{
+	int32_t value = *ptr;
+	__asm__ __volatile__ ("" : : : "memory");
+	return value;
+}
+
+inline void atomic_store(int32_t value, volatile int32_t *ptr)
+{
+	__asm__ __volatile__ ("" : : : "memory");
+	*ptr = value;
+}
+
 inline int32_t atomic_or(int32_t value, volatile int32_t *ptr)
 {
 	int32_t prev, status;
@@ -0,0 +1,256 @@
+#include <codec.h>
+#include <zip.h>
+#include <lz.h>
+#include <vector>
+#include <algorithm>
+#include <memory.h>
+
+typedef std::vector<byte> ByteArray;
+
+#define LZSTORED 0x80000000
+
+//
+// the LZ codec cuts the content into blocks of LZ_MAXBLOCK bytes, each
+// one behind a header of its compressed length (top bit set when kept
+// as is because it did not shrink) and its length; an empty header
+// ends the content, so that it can be read without knowing its size
+//
+#pragma pack(1)
+struct LzBlockHeader
+{
+	uint32_t compressedSize;
+	uint32_t size;
+};
+#pragma pack()
+
+class LzEncoder
+	: public Encoder
+{
+public:
+	LzEncoder(DataOutput* output)
+	{
+		_dstOutput = output;
+		_written = 0;
+		_block.reserve(LZ_MAXBLOCK);
+		_compressed.resize(sizeof(LzBlockHeader) + LzBound(LZ_MAXBLOCK));
+	}
+
+public:
+	bool write(const byte *data, long len)
+	{
+		while (len > 0)
+		{
+			long cb = std::min(len, (long)(LZ_MAXBLOCK - _block.size()));
+			_block.insert(_block.end(), data, data + cb);
+			data += cb;
+			len -= cb;
+			if (_block.size() == LZ_MAXBLOCK && !_flushBlock())
+				return false;
+		}
+		return true;
+	}
+
+	bool finish()
+	{
+		if (!_block.empty() && !_flushBlock())
+			return false;
+		LzBlockHeader end;
+		end.compressedSize = 0;
+		end.size = 0;
+		if (!WriteData(_dstOutput, end))
+			return false;
+		_written += sizeof(end);
+		return true;
+	}
+
+	uint64_t written() const
+	{
+		return _written;
+	}
+
+private:
+	bool _flushBlock()
+	{
+		LzBlockHeader header;
+		header.size = _block.size();
+		byte* payload = &_compressed[sizeof(LzBlockHeader)];
+		long cb = LzCompress(_block.data(), _block.size(), payload, _compressed.size() - sizeof(LzBlockHeader));
+		if (cb < 0 || cb >= (long)_block.size())
+		{
+			cb = _block.size();
+			::memcpy(payload, _block.data(), cb);
+			header.compressedSize = cb | LZSTORED;
+		}
+		else
+			header.compressedSize = cb;
+		::memcpy(&_compressed[0], &header, sizeof(header));
+		cb += sizeof(header);
+		_block.clear();
+		if (_dstOutput->write(&_compressed[0], cb) != cb)
+			return false;
+		_written += cb;
+		return true;
+	}
+
+	DataOutput* _dstOutput;
+	uint64_t _written;
+	ByteArray _block;
+	ByteArray _compressed;
+};
+
+class LzDecoder
+	: public DataInput
+{
+public:
+	LzDecoder(DataInput* source, long size)
+	{
+		_srcInput = source;
+		_size = size;
+		_position = 0;
+		_offset = 0;
+		_blockPos = 0;
+	}
+
+	~LzDecoder()
+	{
+		_srcInput.clear();
+	}
+
+public:
+	long read(byte *data, long len)
+	{
+		long total = 0;
+		while (total < len && (_size < 0 || _position < _size))
+		{
+			if (_blockPos == (long)_block.size())
+			{
+				//
+				// whole blocks asked for go straight to the caller
+				//
+				long cb = _nextBlock(data + total, len - total);
+				if (cb < 0)
+					return total > 0 ? total : -1;
+				if (cb > 0)
+				{
+					total += cb;
+					_position += cb;
+					continue;
+				}
+			}
+			long cb = std::min(len - total, (long)_block.size() - _blockPos);
+			::memcpy(data + total, &_block[_blockPos], cb);
+			_blockPos += cb;
+			total += cb;
+			_position += cb;
+		}
+		return total;
+	}
+
+	long position() const
+	{
+		return _position;
+	}
+
+	long size() const
+	{
+		return _size;
+	}
+
+private:
+	//
+	// decodes the next block into data when it fits there and returns its
+	// length, otherwise into the block buffer and returns 0
+	//
+	long _nextBlock(byte* data, long len)
+	{
+		LzBlockHeader header;
+		if (!ReadDataAt(_srcInput.get(), _offset, header))
+			return -1;
+		long compressedSize = header.compressedSize & ~LZSTORED;
+		if (header.compressedSize == 0 && header.size == 0)
+		{
+			_offset += sizeof(header);
+			_size = _position;
+			return 0;
+		}
+		if (header.size > LZ_MAXBLOCK || compressedSize > LzBound(LZ_MAXBLOCK))
+			return -1;
+
+		//
+		// a stored block is its payload, copied into room for size bytes
+		//
+		if ((header.compressedSize & LZSTORED) && compressedSize != (long)header.size)
+			return -1;
+		_offset += sizeof(header);
+		const byte* payload = _srcInput->data();
+		if (payload)
+		{
+			if (_offset + compressedSize > _srcInput->size())
+				return -1;
+			payload += _offset;
+		}
+		else
+		{
+			_compressed.resize(compressedSize);
+			if (_srcInput->readAt(_offset, _compressed.data(), compressedSize) != compressedSize)
+				return -1;
+			payload = _compressed.data();
+		}
+		_offset += compressedSize;
+
+		bool direct = (len >= (long)header.size);
+		byte* target = data;
+		if (!direct)
+		{
+			_block.resize(header.size);
+			_blockPos = 0;
+			target = _block.data();
+		}
+		long cb;
+		if (header.compressedSize & LZSTORED)
+		{
+			cb = compressedSize;
+			::memcpy(target, payload, cb);
+		}
+		else
+			cb = LzDecompress(payload, compressedSize, target, header.size);
+		if (cb != (long)header.size)
+			return -1;
+		if (!direct)
+			return 0;
+		_block.clear();
+		_blockPos = 0;
+		return cb;
+	}
+
+	StrongPtr<DataInput> _srcInput;
+	long _size;
+	long _position;
+	long _offset;
+	long _blockPos;
+	ByteArray _block;
+	ByteArray _compressed;
+};
+
+class LzCodec
+	: public Codec
+{
+public:
+	StrongPtr<Encoder> encoder(DataOutput* output)
+	{
+		return new LzEncoder(output);
+	}
+
+	StrongPtr<DataInput> decoder(DataInput* source, long size)
+	{
+		return new LzDecoder(source, size);
+	}
+};
+
+Codec* Codec::find(int method)
+{
+	static LzCodec lz;
+	if (method == ZipWritter::methodLz)
+		return &lz;
+	return NULL;
+}
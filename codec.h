@@ -0,0 +1,42 @@
+#ifndef BPSLAB_CODEC_H
+#define BPSLAB_CODEC_H
+
+#include <io.h>
+
+//
+// compressor of one entry, writes compressed bytes to the output it was
+// made for as they come and counts them
+//
+class Encoder
+	: public Refable
+{
+public:
+	virtual ~Encoder() {}
+	virtual bool write(const byte *data, long len) = 0;
+	virtual bool finish() = 0;
+	virtual uint64_t written() const = 0;
+};
+
+//
+// compression method of an archive entry beyond the built-in store and
+// deflate paths, looked up by its method id
+//
+class Codec
+{
+public:
+	virtual ~Codec() {}
+	virtual StrongPtr<Encoder> encoder(DataOutput* output) = 0;
+	//
+	// yields size bytes of content, reading the compressed ones from
+	// source front to back; a size below zero reads on to the end the
+	// encoder marked, for entries whose sizes trail the data
+	//
+	virtual StrongPtr<DataInput> decoder(DataInput* source, long size) = 0;
+public:
+	//
+	// NULL for methods without a codec
+	//
+	static Codec* find(int method);
+};
+
+#endif // BPSLAB_CODEC_H
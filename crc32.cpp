@@ -0,0 +1,180 @@
+#include <crc32.h>
+#include <zlib.h>
+#include <algorithm>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CRC32_CLMUL
+#include <immintrin.h>
+#endif
+
+#define CRC32_POLY 0xEDB88320U
+#define CRC32_CHUNK 0x40000000L
+
+#ifdef CRC32_CLMUL
+//
+// folds 64 bytes at a time with carry-less multiplies, then reduces to
+// 32 bits (Barrett); len is at least 64 and a multiple of 16, crc is the
+// inverted running value
+//
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t _crc32Clmul(uint32_t crc, const byte* data, long len)
+{
+	alignas(16) static const uint64_t k1k2[] = { 0x0154442bd4, 0x01c6e41596 };
+	alignas(16) static const uint64_t k3k4[] = { 0x01751997d0, 0x00ccaa009e };
+	alignas(16) static const uint64_t k5k0[] = { 0x0163cd6124, 0x0000000000 };
+	alignas(16) static const uint64_t poly[] = { 0x01db710641, 0x01f7011641 };
+
+	__m128i x0, x1, x2, x3, x4, x5, x6, x7, x8;
+	x1 = _mm_loadu_si128((const __m128i*)(data + 0x00));
+	x2 = _mm_loadu_si128((const __m128i*)(data + 0x10));
+	x3 = _mm_loadu_si128((const __m128i*)(data + 0x20));
+	x4 = _mm_loadu_si128((const __m128i*)(data + 0x30));
+	x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+	x0 = _mm_load_si128((const __m128i*)k1k2);
+	data += 64;
+	len -= 64;
+
+	while (len >= 64)
+	{
+		x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+		x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+		x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+		x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+		x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+		x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128((const __m128i*)(data + 0x00)));
+		x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128((const __m128i*)(data + 0x10)));
+		x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128((const __m128i*)(data + 0x20)));
+		x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128((const __m128i*)(data + 0x30)));
+		data += 64;
+		len -= 64;
+	}
+
+	//
+	// four lanes into one
+	//
+	x0 = _mm_load_si128((const __m128i*)k3k4);
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+	while (len >= 16)
+	{
+		x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, _mm_loadu_si128((const __m128i*)data)), x5);
+		data += 16;
+		len -= 16;
+	}
+
+	//
+	// 128 bits down to 64, then the reduction
+	//
+	x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+	x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+	x1 = _mm_srli_si128(x1, 8);
+	x1 = _mm_xor_si128(x1, x2);
+	x0 = _mm_loadl_epi64((const __m128i*)k5k0);
+	x2 = _mm_srli_si128(x1, 4);
+	x1 = _mm_and_si128(x1, x3);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	x0 = _mm_load_si128((const __m128i*)poly);
+	x2 = _mm_and_si128(x1, x3);
+	x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+	x2 = _mm_and_si128(x2, x3);
+	x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+	return (uint32_t)_mm_extract_epi32(x1, 1);
+}
+
+static bool _hasClmul()
+{
+	static const bool has = __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1");
+	return has;
+}
+#endif
+
+uint32_t Crc32(uint32_t crc, const byte* data, long len)
+{
+#ifdef CRC32_CLMUL
+	if (len >= 64 && _hasClmul())
+	{
+		long cb = len & ~15L;
+		crc = ~_crc32Clmul(~crc, data, cb);
+		data += cb;
+		len -= cb;
+	}
+#endif
+	//
+	// zlib counts in 32 bits
+	//
+	while (len > 0)
+	{
+		uInt cb = (uInt)std::min(len, CRC32_CHUNK);
+		crc = ::crc32(crc, data, cb);
+		data += cb;
+		len -= cb;
+	}
+	return crc;
+}
+
+//
+// a * b modulo the polynomial, bit reflected
+//
+static uint32_t _multiply(uint32_t a, uint32_t b)
+{
+	uint32_t product = 0;
+	for (uint32_t m = 1U << 31; m != 0; m >>= 1)
+	{
+		if (a & m)
+		{
+			product ^= b;
+			if ((a & (m - 1)) == 0)
+				break;
+		}
+		b = (b & 1) ? (b >> 1) ^ CRC32_POLY : b >> 1;
+	}
+	return product;
+}
+
+struct Crc32Powers
+{
+	//
+	// x^(2^n) modulo the polynomial
+	//
+	uint32_t power[32];
+
+	Crc32Powers()
+	{
+		uint32_t p = 1U << 30;
+		power[0] = p;
+		for (int n = 1; n < 32; n++)
+			power[n] = p = _multiply(p, p);
+	}
+};
+
+uint32_t Crc32Combine(uint32_t crc1, uint32_t crc2, uint64_t len2)
+{
+	static const Crc32Powers powers;
+
+	//
+	// shift crc1 over len2 zero bytes, that is times x^(8 len2)
+	//
+	uint32_t shift = 1U << 31;
+	for (int k = 3; len2 != 0; len2 >>= 1, k++)
+	{
+		if (len2 & 1)
+			shift = _multiply(powers.power[k & 31], shift);
+	}
+	return _multiply(shift, crc1) ^ crc2;
+}
@@ -0,0 +1,19 @@
+#ifndef BPSLAB_CRC32_H
+#define BPSLAB_CRC32_H
+
+#include <global.h>
+#include <stdint.h>
+
+//
+// CRC-32 of the zip format (IEEE polynomial), continuing from crc; 0
+// starts a new one. Folds with PCLMULQDQ when the cpu has it, zlib
+// otherwise
+//
+uint32_t Crc32(uint32_t crc, const byte* data, long len);
+//
+// CRC of the concatenation of two pieces, given the CRC of each and the
+// length of the second one
+//
+uint32_t Crc32Combine(uint32_t crc1, uint32_t crc2, uint64_t len2);
+
+#endif // BPSLAB_CRC32_H
@@ -2,24 +2,43 @@
 #include <unistd.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <memory.h>
+#include <algorithm>
 
 class FileOutput
 	: public DataOutput
 {
 public:
-	FileOutput(const wstr& filePath)
+	FileOutput(const wstr& filePath, int flags = O_CREAT | O_TRUNC)
 	{
 		str fn = ws2s(filePath);
-		_fd = ::open(fn.c_str(), O_WRONLY | O_CREAT, S_IRUSR | S_IWUSR);
+		_fd = ::open(fn.c_str(), O_WRONLY | flags, S_IRUSR | S_IWUSR);
+		_seekable = (::lseek(_fd, 0, SEEK_CUR) != -1);
 	}
 	~FileOutput()
 	{
 		::close(_fd);
 	}
 public:
+	//
+	// pipes and sockets take a write in pieces
+	//
 	long write(const byte *data, long len)
 	{
-		return ::write(_fd, data, len);
+		long done = 0;
+		while (done < len)
+		{
+			long cb = ::write(_fd, data + done, len - done);
+			if (cb == -1 && errno == EINTR)
+				continue;
+			if (cb <= 0)
+				return done > 0 ? done : -1;
+			done += cb;
+		}
+		return done;
 	}
 	long seek(long pos, int whence = SEEK_SET)
 	{
@@ -35,10 +54,15 @@ public:
 	}
 	bool seekable() const
 	{
-		return true;
+		return _seekable;
+	}
+	bool good() const
+	{
+		return _fd != -1;
 	}
 private:
 	int _fd;
+	bool _seekable;
 };
 
 class FileInput
@@ -62,6 +86,10 @@ public:
 	{
 		return ::read(_fd, data, len);
 	}
+	long readAt(long pos, byte *data, long len)
+	{
+		return ::pread(_fd, data, len, pos);
+	}
 	long seek(long pos, int whence = SEEK_SET)
 	{
 		return ::lseek(_fd, pos, whence);
@@ -87,12 +115,258 @@ private:
 	long _flen;
 };
 
+class MemoryInput
+	: public DataInput
+{
+public:
+	MemoryInput(const byte* data, long len, Refable* owner)
+	{
+		_data = data;
+		_len = len;
+		_pos = 0;
+		_owner = owner;
+	}
+	~MemoryInput()
+	{
+		_owner.clear();
+	}
+public:
+	long read(byte *data, long len)
+	{
+		long cb = std::min(len, _len - _pos);
+		if (cb <= 0)
+			return 0;
+		::memcpy(data, _data + _pos, cb);
+		_pos += cb;
+		return cb;
+	}
+	long readAt(long pos, byte *data, long len)
+	{
+		long cb = std::min(len, _len - pos);
+		if (pos < 0)
+			return -1;
+		if (cb <= 0)
+			return 0;
+		::memcpy(data, _data + pos, cb);
+		return cb;
+	}
+	long seek(long pos, int whence = SEEK_SET)
+	{
+		if (whence == SEEK_CUR)
+			pos += _pos;
+		else if (whence == SEEK_END)
+			pos += _len;
+		if (pos < 0 || pos > _len)
+			return -1;
+		_pos = pos;
+		return _pos;
+	}
+	long skip(long n)
+	{
+		return seek(n, SEEK_CUR);
+	}
+	long position() const
+	{
+		return _pos;
+	}
+	long size() const
+	{
+		return _len;
+	}
+	bool seekable() const
+	{
+		return true;
+	}
+	const byte* data() const
+	{
+		return _data;
+	}
+protected:
+	const byte* _data;
+	long _len;
+	long _pos;
+	StrongPtr<Refable> _owner;
+};
+
+class RangeInput
+	: public DataInput
+{
+public:
+	RangeInput(DataInput* input, long begin, long len)
+	{
+		_srcInput = input;
+		_begin = begin;
+		_len = len;
+		_pos = 0;
+	}
+	~RangeInput()
+	{
+		_srcInput.clear();
+	}
+public:
+	long read(byte *data, long len)
+	{
+		long cb = readAt(_pos, data, len);
+		if (cb > 0)
+			_pos += cb;
+		return cb;
+	}
+	long readAt(long pos, byte *data, long len)
+	{
+		if (pos < 0)
+			return -1;
+		long cb = std::min(len, _len - pos);
+		if (cb <= 0)
+			return 0;
+		return _srcInput->readAt(_begin + pos, data, cb);
+	}
+	long seek(long pos, int whence = SEEK_SET)
+	{
+		if (whence == SEEK_CUR)
+			pos += _pos;
+		else if (whence == SEEK_END)
+			pos += _len;
+		if (pos < 0 || pos > _len)
+			return -1;
+		_pos = pos;
+		return _pos;
+	}
+	long skip(long n)
+	{
+		return seek(n, SEEK_CUR);
+	}
+	long position() const
+	{
+		return _pos;
+	}
+	long size() const
+	{
+		return _len;
+	}
+	bool seekable() const
+	{
+		return true;
+	}
+	const byte* data() const
+	{
+		const byte* data = _srcInput->data();
+		return data ? data + _begin : 0;
+	}
+private:
+	StrongPtr<DataInput> _srcInput;
+	long _begin;
+	long _len;
+	long _pos;
+};
+
+class MappedInput
+	: public MemoryInput
+{
+public:
+	MappedInput(const wstr& filePath)
+		: MemoryInput(0, 0, 0)
+	{
+		str fn = ws2s(filePath);
+		int fd = ::open(fn.c_str(), O_RDONLY);
+		if (fd == -1)
+			return;
+		struct stat buf = {0};
+		if (::fstat(fd, &buf) == 0 && buf.st_size > 0)
+		{
+			void* p = ::mmap(0, buf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+			if (p != MAP_FAILED)
+			{
+				_data = (const byte*)p;
+				_len = buf.st_size;
+			}
+		}
+		::close(fd);
+	}
+	~MappedInput()
+	{
+		if (_data)
+			::munmap((void*)_data, _len);
+	}
+};
+
 StrongPtr<DataInput> OpenFile(const wstr& name)
 {
 	return new FileInput(name);
 }
 
+StrongPtr<DataInput> OpenMappedFile(const wstr& name)
+{
+	return new MappedInput(name);
+}
+
+StrongPtr<DataInput> OpenMemory(const byte* data, long len, Refable* owner)
+{
+	return new MemoryInput(data, len, owner);
+}
+
+StrongPtr<DataInput> OpenRange(DataInput* input, long pos, long len)
+{
+	return new RangeInput(input, pos, len);
+}
+
 StrongPtr<DataOutput> CreateFile(const wstr& name)
 {
 	return new FileOutput(name);
 }
+
+StrongPtr<DataOutput> OpenFileForWrite(const wstr& name)
+{
+	StrongPtr<FileOutput> output = new FileOutput(name, 0);
+	if (!output->good())
+		return NULL;
+	return output.get();
+}
+
+bool TruncateFile(const wstr& name, long size)
+{
+	return ::truncate(ws2s(name).c_str(), size) == 0;
+}
+
+StrongPtr<DataOutput> CreateTempFile(wstr& name)
+{
+	const char* dir = ::getenv("TMPDIR");
+	return CreateTempFile(name, s2ws(str(dir && *dir ? dir : "/tmp") + "/bpslab."));
+}
+
+StrongPtr<DataOutput> CreateTempFile(wstr& name, const wstr& prefix)
+{
+	str path = ws2s(prefix) + "XXXXXX";
+	int fd = ::mkstemp(&path[0]);
+	if (fd == -1)
+		return NULL;
+	::close(fd);
+	name = s2ws(path);
+	return new FileOutput(name);
+}
+
+bool RenameFile(const wstr& from, const wstr& to)
+{
+	return ::rename(ws2s(from).c_str(), ws2s(to).c_str()) == 0;
+}
+
+bool RemoveFile(const wstr& name)
+{
+	return ::unlink(ws2s(name).c_str()) == 0;
+}
+
+bool CreateFolder(const wstr& name)
+{
+	str path = ws2s(name);
+	if (path.empty())
+		return false;
+	for (str::size_type pos = path.find('/', 1); ; pos = path.find('/', pos + 1))
+	{
+		str folder = path.substr(0, pos);
+		if (::mkdir(folder.c_str(), S_IRWXU | S_IRWXG | S_IRWXO) == -1 && errno != EEXIST)
+			return false;
+		if (pos == str::npos)
+			break;
+	}
+	struct stat buf = {0};
+	return (::stat(path.c_str(), &buf) == 0 && S_ISDIR(buf.st_mode));
+}
@@ -11,11 +11,26 @@ class DataInput
 public:
 	virtual ~DataInput() {}
 	virtual long read(byte *data, long len) { return -1; }
+	//
+	// positional read, does not move position(); overrides must be
+	// safe to call from several threads at once
+	//
+	virtual long readAt(long pos, byte *data, long len)
+	{
+		if (seek(pos) == -1)
+			return -1;
+		return read(data, len);
+	}
 	virtual long seek(long pos, int whence = 0) { return -1; }
 	virtual bool seekable() const { return false; }
 	virtual long skip(long n) { return -1; }
 	virtual long position() const { return -1; }
 	virtual long size() const { return -1; }
+	//
+	// whole content when it is resident in memory, NULL otherwise,
+	// the length is size()
+	//
+	virtual const byte* data() const { return 0; }
 };
 
 class DataOutput
@@ -43,12 +58,21 @@ inline static bool ReadData(DataInput* input, tp& data)
 template<class tp>
 inline static bool ReadData(DataInput* input, tp* data, int num)
 {
-	long cb = input->read(data, num * sizeof(tp));
+	long cb = input->read((byte*)data, num * sizeof(tp));
 	if (cb == -1 || num * sizeof(tp) != cb)
 		return false;
 	return true;
 }
 
+template<class tp>
+inline static bool ReadDataAt(DataInput* input, long pos, tp& data)
+{
+	long cb = input->readAt(pos, (byte*)&data, sizeof(tp));
+	if (cb == -1 || sizeof(tp) != cb)
+		return false;
+	return true;
+}
+
 template<class tp>
 inline static bool WriteData(DataOutput* output, const tp& data)
 {
@@ -68,6 +92,28 @@ inline static bool WriteData(DataOutput* output, const tp* data, int num)
 }
 
 StrongPtr<DataInput> OpenFile(const wstr&);
+StrongPtr<DataInput> OpenMappedFile(const wstr&);
+StrongPtr<DataInput> OpenMemory(const byte* data, long len, Refable* owner = NULL);
+//
+// len bytes of input from pos on, read through positional reads so that
+// it does not disturb other users of input
+//
+StrongPtr<DataInput> OpenRange(DataInput* input, long pos, long len);
 StrongPtr<DataOutput> CreateFile(const wstr&);
+//
+// existing file, left as it is and written from its start on
+//
+StrongPtr<DataOutput> OpenFileForWrite(const wstr&);
+bool TruncateFile(const wstr&, long size);
+//
+// new empty file below $TMPDIR (or /tmp), its path is stored in name and
+// the caller removes it; the second form makes it prefix followed by six
+// random characters, next to a file it is to be renamed over
+//
+StrongPtr<DataOutput> CreateTempFile(wstr& name);
+StrongPtr<DataOutput> CreateTempFile(wstr& name, const wstr& prefix);
+bool RenameFile(const wstr& from, const wstr& to);
+bool RemoveFile(const wstr&);
+bool CreateFolder(const wstr&);
 
 #endif // BPSLAB_IO_H
@@ -0,0 +1,215 @@
+#include <lz.h>
+#include <stdint.h>
+#include <memory.h>
+
+#define HASHLOG 12
+#define MINMATCH 4
+#define MFLIMIT 12
+#define LASTLITERALS 5
+
+static inline uint32_t _read32(const byte* p)
+{
+	uint32_t value;
+	::memcpy(&value, p, sizeof(value));
+	return value;
+}
+
+static inline uint64_t _read64(const byte* p)
+{
+	uint64_t value;
+	::memcpy(&value, p, sizeof(value));
+	return value;
+}
+
+static inline uint32_t _hash(uint32_t value)
+{
+	return (value * 2654435761U) >> (32 - HASHLOG);
+}
+
+static inline byte* _writeLength(byte* op, long len)
+{
+	for (; len >= 255; len -= 255)
+		*op++ = 255;
+	*op++ = (byte)len;
+	return op;
+}
+
+static inline bool _readLength(const byte*& ip, const byte* end, long& len)
+{
+	byte s;
+	do
+	{
+		if (ip >= end)
+			return false;
+		s = *ip++;
+		len += s;
+	} while (s == 255);
+	return true;
+}
+
+//
+// length of the common run at a and b, stopping before limit
+//
+static inline long _count(const byte* a, const byte* b, const byte* limit)
+{
+	const byte* start = a;
+	while (a + 8 <= limit)
+	{
+		uint64_t diff = _read64(a) ^ _read64(b);
+		if (diff)
+			return (a - start) + (__builtin_ctzll(diff) >> 3);
+		a += 8;
+		b += 8;
+	}
+	while (a < limit && *a == *b)
+	{
+		a++;
+		b++;
+	}
+	return a - start;
+}
+
+long LzBound(long len)
+{
+	return len + len / 255 + 16;
+}
+
+long LzCompress(const byte* src, long len, byte* dst, long capacity)
+{
+	if (len > LZ_MAXBLOCK || capacity < LzBound(len))
+		return -1;
+	uint16_t table[1 << HASHLOG];
+	::memset(table, 0, sizeof(table));
+	const byte* ip = src;
+	const byte* anchor = src;
+	const byte* end = src + len;
+	const byte* mflimit = end - MFLIMIT;
+	const byte* matchlimit = end - LASTLITERALS;
+	byte* op = dst;
+
+	if (len >= MFLIMIT + 1)
+	{
+		ip++;
+		while (ip < mflimit)
+		{
+			uint32_t h = _hash(_read32(ip));
+			const byte* ref = src + table[h];
+			table[h] = (uint16_t)(ip - src);
+			if (ref >= ip || _read32(ref) != _read32(ip))
+			{
+				//
+				// skip faster through data that does not match
+				//
+				ip += 1 + ((ip - anchor) >> 6);
+				continue;
+			}
+			while (ip > anchor && ref > src && ip[-1] == ref[-1])
+			{
+				ip--;
+				ref--;
+			}
+			long literals = ip - anchor;
+			long match = MINMATCH + _count(ip + MINMATCH, ref + MINMATCH, matchlimit);
+
+			byte* token = op++;
+			*token = (byte)((literals >= 15 ? 15 : literals) << 4);
+			if (literals >= 15)
+				op = _writeLength(op, literals - 15);
+			::memcpy(op, anchor, literals);
+			op += literals;
+			long offset = ip - ref;
+			*op++ = (byte)offset;
+			*op++ = (byte)(offset >> 8);
+			long extra = match - MINMATCH;
+			*token |= (byte)(extra >= 15 ? 15 : extra);
+			if (extra >= 15)
+				op = _writeLength(op, extra - 15);
+
+			ip += match;
+			anchor = ip;
+			if (ip < mflimit)
+				table[_hash(_read32(ip - 2))] = (uint16_t)(ip - 2 - src);
+		}
+	}
+
+	long literals = end - anchor;
+	*op++ = (byte)((literals >= 15 ? 15 : literals) << 4);
+	if (literals >= 15)
+		op = _writeLength(op, literals - 15);
+	::memcpy(op, anchor, literals);
+	op += literals;
+	return op - dst;
+}
+
+long LzDecompress(const byte* src, long len, byte* dst, long capacity)
+{
+	const byte* ip = src;
+	const byte* iend = src + len;
+	byte* op = dst;
+	byte* oend = dst + capacity;
+	while (ip < iend)
+	{
+		byte token = *ip++;
+		long literals = token >> 4;
+
+		//
+		// short literal runs away from both ends are copied as a fixed
+		// 16 bytes, which stays inline, and the pointers moved by the run
+		//
+		if (literals < 15 && iend - ip >= 16 && oend - op >= 16)
+		{
+			::memcpy(op, ip, 16);
+			ip += literals;
+			op += literals;
+		}
+		else
+		{
+			if (literals == 15 && !_readLength(ip, iend, literals))
+				return -1;
+			if (literals > iend - ip || literals > oend - op)
+				return -1;
+			::memcpy(op, ip, literals);
+			ip += literals;
+			op += literals;
+			if (ip == iend)
+				break;
+		}
+
+		if (iend - ip < 2)
+			return -1;
+		long offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+		if (offset == 0 || offset > op - dst)
+			return -1;
+		long match = token & 15;
+		if (match == 15 && !_readLength(ip, iend, match))
+			return -1;
+		match += MINMATCH;
+		if (match > oend - op)
+			return -1;
+
+		//
+		// eight bytes at a time when the copy cannot overlap within a
+		// step and may run a little past its end
+		//
+		const byte* ref = op - offset;
+		if (offset >= 8 && oend - op >= match + 8)
+		{
+			byte* stop = op + match;
+			do
+			{
+				::memcpy(op, ref, 8);
+				op += 8;
+				ref += 8;
+			} while (op < stop);
+			op = stop;
+		}
+		else
+		{
+			for (long i = 0; i < match; i++)
+				op[i] = ref[i];
+			op += match;
+		}
+	}
+	return op - dst;
+}
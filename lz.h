@@ -0,0 +1,24 @@
+#ifndef BPSLAB_LZ_H
+#define BPSLAB_LZ_H
+
+#include <global.h>
+
+//
+// LZ4-style block compression: sequences of literals and 16-bit offset
+// matches, no entropy coding, built for decompression speed; a block is
+// at most LZ_MAXBLOCK bytes and independent of any other
+//
+#define LZ_MAXBLOCK 65536
+
+long LzBound(long len);
+//
+// compressed length, or -1 when it does not fit in capacity
+//
+long LzCompress(const byte* src, long len, byte* dst, long capacity);
+//
+// decompressed length, or -1 on broken input or when it does not fit in
+// capacity
+//
+long LzDecompress(const byte* src, long len, byte* dst, long capacity);
+
+#endif // BPSLAB_LZ_H
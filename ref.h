@@ -437,7 +437,7 @@ public:
 		if (_ptr)
 			_ref->decWeak(this);
 		_ptr = other;
-		_ref = other->_ref;
+		_ref = other ? other->_ref : NULL;
 		return *this;
 	}
 	WeakPtr& operator=(const WeakPtr<T>& other)
@@ -457,7 +457,7 @@ public:
 		if (_ptr)
 			_ref->decWeak(this);
 		_ptr = other._ptr;
-		_ref = other->_ref;
+		_ref = other._ptr ? other->_ref : NULL;
 		return *this;
 	}
 	template<typename U>
@@ -468,7 +468,7 @@ public:
 		if (_ptr)
 			_ref->decWeak(this);
 		_ptr = other;
-		_ref = other->_ref;
+		_ref = other ? other->_ref : NULL;
 		return *this;
 	}
 	template<typename U>
@@ -27,3 +27,13 @@ str ws2s(const wstr& ws)
 	s.resize(n);
 	return s;
 }
+
+wstr s2ws(const str& s)
+{
+	wstr ws(s.length() + 1, 0);
+	size_t n = mbstowcs(&ws[0], s.c_str(), ws.length());
+	if (n == (size_t)-1)
+		return wstr();
+	ws.resize(n);
+	return ws;
+}
@@ -14,6 +14,7 @@ typedef std::string str;
 typedef std::basic_string<wchar> wstr;
 
 str ws2s(const wstr& ws);
+wstr s2ws(const str& s);
 
 extern const unsigned char g_table_upcase[256];
 
@@ -46,6 +47,15 @@ inline bool compare(const ch *p1, uint32_t size1, const ch *p2, uint32_t size2,
 	return true;
 }
 
+template<class ch>
+inline uint32_t hash(const ch *p, uint32_t size)
+{
+	uint32_t h = 2166136261u;
+	for (const ch *end = p + size; p < end; ++p)
+		h = (h ^ static_cast<unsigned char>(*p)) * 16777619u;
+	return h;
+}
+
 template<class ch>
 inline bool compare(const ch* p1, const ch* p2, bool case_sensitive = true)
 {
@@ -0,0 +1,80 @@
+#include <thread.h>
+#include <deque>
+#include <vector>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <algorithm>
+
+class ThreadPoolImpl
+	: public ThreadPool
+{
+public:
+	ThreadPoolImpl(int threads)
+	{
+		_stopped = false;
+		for (int i = 0; i < threads; i++)
+			_threads.push_back(std::thread(&ThreadPoolImpl::_run, this));
+	}
+
+	~ThreadPoolImpl()
+	{
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			_stopped = true;
+		}
+		_ready.notify_all();
+		for (size_t i = 0; i < _threads.size(); i++)
+			_threads[i].join();
+	}
+
+public:
+	std::future<void> post(const std::function<void()>& task)
+	{
+		std::packaged_task<void()> packaged(task);
+		std::future<void> done = packaged.get_future();
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			_tasks.push_back(std::move(packaged));
+		}
+		_ready.notify_one();
+		return done;
+	}
+
+	int size() const
+	{
+		return _threads.size();
+	}
+
+private:
+	void _run()
+	{
+		for (;;)
+		{
+			std::packaged_task<void()> task;
+			{
+				std::unique_lock<std::mutex> lock(_mutex);
+				while (!_stopped && _tasks.empty())
+					_ready.wait(lock);
+				if (_tasks.empty())
+					return;
+				task = std::move(_tasks.front());
+				_tasks.pop_front();
+			}
+			task();
+		}
+	}
+
+	std::mutex _mutex;
+	std::condition_variable _ready;
+	std::deque<std::packaged_task<void()> > _tasks;
+	std::vector<std::thread> _threads;
+	bool _stopped;
+};
+
+StrongPtr<ThreadPool> ThreadPool::create(int threads)
+{
+	if (threads <= 0)
+		threads = std::max(1, (int)std::thread::hardware_concurrency());
+	return new ThreadPoolImpl(threads);
+}
@@ -0,0 +1,26 @@
+#ifndef BPSLAB_THREAD_H
+#define BPSLAB_THREAD_H
+
+#include <ref.h>
+#include <functional>
+#include <future>
+
+//
+// fixed set of worker threads taking posted tasks in the order they were
+// posted; the returned future is ready once the task has run
+//
+class ThreadPool
+	: public Refable
+{
+public:
+	virtual ~ThreadPool() {}
+	virtual std::future<void> post(const std::function<void()>& task) = 0;
+	virtual int size() const = 0;
+public:
+	//
+	// threads <= 0 picks one per core
+	//
+	static StrongPtr<ThreadPool> create(int threads = 0);
+};
+
+#endif // BPSLAB_THREAD_H
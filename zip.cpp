@@ -1,30 +1,100 @@
 ﻿#include <zip.h>
+#include <atomic.h>
+#include <thread.h>
+#include <codec.h>
+#include <crc32.h>
 #include <zlib.h>
 #include <map>
+#include <set>
+#include <list>
+#include <deque>
+#include <unordered_map>
 #include <vector>
+#include <mutex>
+#include <thread>
+#include <algorithm>
+#include <chrono>
 #include <memory.h>
 #include <assert.h>
 
 #define BUFSIZE 4096
+#define SPANSIZE 1048576
+#define BLOCKSIZE 1073741824
+#define SAMPLESIZE 65536
+#define DEFLATEBLOCK 131072
+#define SPILLSIZE 8388608
+#define ADJUSTSIZE 1048576
+#define RUNSIZE 8388608
+#define RUNGAP 262144
+#define COPYSIZE 1048576
+#define CHUNKSIZE 1048576
 typedef std::vector<byte> ByteArray;
 
 #pragma pack(1)
-struct Zip64ExtraField
+struct Zip64DataDescriptor
+{
+	uint32_t signature;
+	uint32_t crc32;
+	uint64_t compressedSize;
+	uint64_t uncompressedSize;
+
+	Zip64DataDescriptor()
+	{
+		signature = 0x08074B50;
+		crc32 = 0;
+		compressedSize = 0;
+		uncompressedSize = 0;
+	}
+
+	bool write(DataOutput* output)
+	{
+		return WriteData(output, *this);
+	}
+};
+
+//
+// Zip64 extended information of a local header, which always carries
+// both sizes
+//
+struct Zip64LocalExtra
 {
 	uint16_t tag;
-	uint16_t sizeOfZip64ExtraField;
+	uint16_t size;
 	uint64_t uncompressedSize;
 	uint64_t compressedSize;
-	uint64_t offsetOfLocalHeader;
-	uint32_t diskNum;
 
-	Zip64ExtraField()
+	Zip64LocalExtra()
 	{
-		::memset(this, 0, 0);
+		tag = 0x0001;
+		size = 16;
+		uncompressedSize = 0;
+		compressedSize = 0;
 	}
-	bool parse(DataInput* input)
+
+	bool write(DataOutput* output)
 	{
-		return ReadData(input, *this);
+		return WriteData(output, *this);
+	}
+};
+
+struct DataDescriptor
+{
+	uint32_t signature;
+	uint32_t crc32;
+	uint32_t compressedSize;
+	uint32_t uncompressedSize;
+
+	DataDescriptor()
+	{
+		signature = 0x08074B50;
+		crc32 = 0;
+		compressedSize = 0;
+		uncompressedSize = 0;
+	}
+
+	bool write(DataOutput* output)
+	{
+		return WriteData(output, *this);
 	}
 };
 
@@ -33,16 +103,25 @@ struct Zip64EndOfCentralDirectoryLocator
 	uint32_t signature;
 	uint32_t numOfDisk;
 	uint64_t relativeOffsetOfCentralDirectory;
-	uint16_t totalNumOfDisk;
+	uint32_t totalNumOfDisk;
 
 	Zip64EndOfCentralDirectoryLocator()
 	{
-		::memset(this, 0, 0);
+		signature = 0x07064B50;
+		numOfDisk = 0;
+		relativeOffsetOfCentralDirectory = 0;
+		totalNumOfDisk = 1;
 	}
+
 	bool parse(DataInput* input)
 	{
 		return ReadData(input, *this);
 	}
+
+	bool write(DataOutput* output)
+	{
+		return WriteData(output, *this);
+	}
 };
 
 struct Zip64EndOfCentralDirectory
@@ -60,13 +139,27 @@ struct Zip64EndOfCentralDirectory
 
 	Zip64EndOfCentralDirectory()
 	{
-		::memset(this, 0, 0);
+		signature = 0x06064B50;
+		sizeOfZip64EndOfCentralDirectory = sizeof(Zip64EndOfCentralDirectory) - 12;
+		versionMadeBy = 45;
+		versionNeededToExtract = 45;
+		diskNum = 0;
+		diskNumOfCentralDirectory = 0;
+		totalEntriesOnThisDisk = 0;
+		totalEntries = 0;
+		sizeOfCentralDirectory = 0;
+		startOfCentralDirectory = 0;
 	}
 
 	bool parse(DataInput* input)
 	{
 		return ReadData(input, *this);
 	}
+
+	bool write(DataOutput* output)
+	{
+		return WriteData(output, *this);
+	}
 };
 
 struct EndOfCentralDirectory
@@ -190,484 +283,3890 @@ struct CentralDirectoryFileHeader
 		return WriteData(output, *this);
 	}
 
-	bool isFloder()
+	bool isFloder() const
 	{
-		return (internalFileAttributes == 0);
+		//
+		// MS-DOS directory attribute, internal attributes are left zero
+		// by many writers for every entry
+		//
+		return (externalFileAttributes & 0x10) != 0;
 	}
 };
 #pragma pack()
 
-typedef std::map<str, CentralDirectoryFileHeader*> FileHeaders;
-
-class ZipOutput
-	: public DataOutput
+//
+// one entry of an archive with its sizes and local header offset widened
+// to 64 bits, the name is kept in a shared name arena at nameOffset
+//
+struct ZipEntry
 {
-public:
-	ZipOutput(DataOutput* output, CentralDirectoryFileHeader* header, EndOfCentralDirectory* endOfCentralDirectory, uint32_t begin)
+	CentralDirectoryFileHeader header;
+	uint64_t compressedSize;
+	uint64_t uncompressedSize;
+	uint64_t offset;
+	uint32_t nameOffset;
+	uint32_t hash;
+
+	ZipEntry(bool floder = false)
+		: header(floder)
 	{
-		_alreadyFlush = false;
-		_header = header;
-		_dstOutput = output;
-		_endOfCentralDirectory = endOfCentralDirectory;
-		_cbDeflated = 0;
-		_begin = begin;
-		_buffer.resize(BUFSIZE);
-		::memset(&_zlibStream, 0, sizeof(z_stream));
-		::deflateInit2(&_zlibStream, Z_DEFAULT_COMPRESSION,
-			Z_DEFLATED, -MAX_WBITS, MAX_MEM_LEVEL, Z_DEFAULT_STRATEGY);
-		_zlibStream.next_out = (Bytef*)&_buffer[0];
-		_zlibStream.avail_out = (uInt)BUFSIZE;
+		compressedSize = 0;
+		uncompressedSize = 0;
+		offset = 0;
+		nameOffset = 0;
+		hash = 0;
 	}
 
-	~ZipOutput()
+	//
+	// takes the header fields, the saturated ones from the Zip64 extended
+	// information found in extra; false if that is missing or truncated
+	//
+	bool widen(const byte* extra, uint32_t length)
 	{
+		uncompressedSize = header.uncompressedSize;
+		compressedSize = header.compressedSize;
+		offset = header.relativeOffsetOfLocalHeader;
+		if (uncompressedSize != 0xFFFFFFFF &&
+			compressedSize != 0xFFFFFFFF &&
+			offset != 0xFFFFFFFF)
+			return true;
+		while (length >= 4)
+		{
+			uint16_t tag = extra[0] + (extra[1] << 8);
+			uint32_t size = extra[2] + (extra[3] << 8);
+			if (size > length - 4)
+				return false;
+			if (tag == 0x0001)
+			{
+				const byte* end = extra + 4 + size;
+				extra += 4;
+				return _widen(uncompressedSize, extra, end) &&
+					_widen(compressedSize, extra, end) &&
+					_widen(offset, extra, end);
+			}
+			extra += 4 + size;
+			length -= 4 + size;
+		}
+		return false;
 	}
 
-public:
-	long write(const byte *data, long len)
+	//
+	// the other way round, saturates the header fields that do not fit in
+	// 32 bits and writes the Zip64 extended information for them to extra
+	// (room for 28 bytes); returns the length of the extra field
+	//
+	uint16_t narrow(byte* extra)
 	{
-		_deflate(data, len, false);
-		return len;
+		uint16_t length = 4;
+		header.uncompressedSize = _narrow(uncompressedSize, extra, length);
+		header.compressedSize = _narrow(compressedSize, extra, length);
+		header.relativeOffsetOfLocalHeader = _narrow(offset, extra, length);
+		if (length == 4)
+			length = 0;
+		else
+		{
+			extra[0] = 0x01;
+			extra[1] = 0x00;
+			extra[2] = (byte)(length - 4);
+			extra[3] = 0x00;
+
+			//
+			// the upper byte names the host the attributes are meant for
+			//
+			header.versionMadeBy = (header.versionMadeBy & 0xFF00) | std::max(header.versionMadeBy & 0xFF, 45);
+			header.versionNeededToExtract = std::max(header.versionNeededToExtract, (uint16_t)45);
+		}
+		header.extraFieldLength = length;
+		return length;
 	}
 
-	void flush()
+private:
+	static bool _widen(uint64_t& value, const byte*& extra, const byte* end)
 	{
-		if (_alreadyFlush)
-			return;
-		_deflate(0, 0, true);
+		if (value != 0xFFFFFFFF)
+			return true;
+		if (end - extra < 8)
+			return false;
+		::memcpy(&value, extra, 8);
+		extra += 8;
+		return true;
+	}
 
-		//
-		// update current local file header record
-		//
-		_dstOutput->seek(_begin + _header->relativeOffsetOfLocalHeader);
-		LocalFileHeader localFileHeader;
-		localFileHeader.crc32 = _header->crc32;
-		localFileHeader.compressedSize = _header->compressedSize;
-		localFileHeader.uncompressedSize = _header->uncompressedSize;
-		localFileHeader.compressionMethod = _header->compressionMethod;
-		localFileHeader.fileNameLength = _header->fileNameLength;
-		localFileHeader.write(_dstOutput);
+	static uint32_t _narrow(uint64_t value, byte* extra, uint16_t& length)
+	{
+		if (value < 0xFFFFFFFF)
+			return (uint32_t)value;
+		::memcpy(extra + length, &value, 8);
+		length += 8;
+		return 0xFFFFFFFF;
+	}
+};
 
-		//
-		// update offset of start of central directory
-		//
-		_dstOutput->skip(_header->fileNameLength + _header->compressedSize);
-		_endOfCentralDirectory->startOfCentralDirectory += _header->compressedSize;
+#pragma pack(1)
+struct ZipIndexHeader
+{
+	uint32_t signature;
+	uint32_t version;
+	uint64_t archiveSize;
+	uint64_t startOfCentralDirectory;
+	uint64_t sizeOfCentralDirectory;
+	uint64_t totalEntries;
+	uint64_t slotCount;
 
-		::deflateEnd(&_zlibStream);
-		_alreadyFlush = true;
+	ZipIndexHeader()
+	{
+		signature = 0x495A5042;
+		version = 1;
+		archiveSize = 0;
+		startOfCentralDirectory = 0;
+		sizeOfCentralDirectory = 0;
+		totalEntries = 0;
+		slotCount = 0;
 	}
 
-private:
-	bool _deflate(const void *pv, long cb, bool flush)
+	bool matches(const ZipIndexHeader& o) const
 	{
-		_zlibStream.next_in = (Bytef*)pv;
-		_zlibStream.avail_in = (uInt)cb;
-
-		if (pv != 0 && cb > 0)
-			_header->crc32 = crc32(_header->crc32, (Bytef*)pv, (uInt)cb);
+		return signature == o.signature &&
+			version == o.version &&
+			archiveSize == o.archiveSize &&
+			startOfCentralDirectory == o.startOfCentralDirectory &&
+			sizeOfCentralDirectory == o.sizeOfCentralDirectory &&
+			totalEntries == o.totalEntries;
+	}
+};
 
-		bool finished = false;
-		do
-		{
-			uint32_t outBefore = _zlibStream.total_out;
-			int err = deflate(&_zlibStream, flush ? Z_FINISH : Z_NO_FLUSH);
-			uint32_t outAfter = _zlibStream.total_out;
-			_cbDeflated += (outAfter - outBefore);
+struct ZipIndexSlot
+{
+	uint64_t offset;
+	uint32_t hash;
+	uint32_t nameLength;
+};
+#pragma pack()
 
-			if (flush || _zlibStream.avail_out == 0)
-			{
-				if (_cbDeflated > 0)
-				{
-					_dstOutput->write(&_buffer[0], _cbDeflated);
-					_header->compressedSize += _cbDeflated;
-					_header->uncompressedSize += _zlibStream.total_in;
-					_zlibStream.total_in = 0;
-					_cbDeflated = 0;
-				}
-				_zlibStream.next_out = (Bytef*)&_buffer[0];
-				_zlibStream.avail_out = (uInt)BUFSIZE;
-			}
+//
+// persistent lookup table kept next to an archive: a header copied from
+// the end of central directory record, followed by a power of two sized
+// open-addressing table whose slots point at central directory records
+// (offset from the start of the central directory plus one, zero if the
+// slot is empty)
+//
+class ZipIndex
+{
+public:
+	ZipIndex(uint64_t entries)
+	{
+		uint64_t size = 16;
+		while (size < entries * 2)
+			size <<= 1;
+		_slots.resize(size);
+		::memset(&_slots[0], 0, size * sizeof(ZipIndexSlot));
+	}
 
-			if (_zlibStream.avail_in != 0 || (flush && err != Z_STREAM_END))
-				finished = false;
-			else
-				finished = true;
+public:
+	void add(const char* name, uint32_t length, uint64_t offset)
+	{
+		uint64_t mask = _slots.size() - 1;
+		uint32_t h = hash(name, length);
+		uint64_t i = h & mask;
+		while (_slots[i].offset != 0)
+			i = (i + 1) & mask;
+		_slots[i].offset = offset + 1;
+		_slots[i].hash = h;
+		_slots[i].nameLength = length;
+	}
 
-		} while (!finished);
+	//
+	// written aside and renamed over path, so that readers with the old
+	// index mapped keep it whole and a crash leaves no torn one behind
+	//
+	bool write(const wstr& path, ZipIndexHeader& header)
+	{
+		wstr temp;
+		StrongPtr<DataOutput> output = CreateTempFile(temp, path + L".");
+		if (output == NULL)
+			return false;
+		header.slotCount = _slots.size();
+		bool written = WriteData(output.get(), header) &&
+			WriteData(output.get(), &_slots[0], _slots.size());
+		output.clear();
+		if (written && RenameFile(temp, path))
+			return true;
+		RemoveFile(temp);
+		return false;
+	}
 
-		return true;
+	static wstr path(const wstr& archive)
+	{
+		return archive + L".idx";
 	}
 
-	bool _alreadyFlush;
-	uint32_t _cbDeflated;
-	uint32_t _begin;
-	z_stream _zlibStream;
-	DataOutput* _dstOutput;
-	ByteArray _buffer;
-	EndOfCentralDirectory* _endOfCentralDirectory;
-	CentralDirectoryFileHeader* _header;
+private:
+	std::vector<ZipIndexSlot> _slots;
 };
 
-class ZipWritterImpl
-	: public ZipWritter
+static double Seconds()
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+//
+// one block of an entry deflated on a pool thread, primed with the last
+// window of the block before it and ended with a sync flush (or the final
+// block) so that the outputs simply concatenate into one stream
+//
+struct ZipDeflateBlock
+{
+	ByteArray input;
+	ByteArray dictionary;
+	ByteArray output;
+	ZipWritter::ItemOptions options;
+	int level;
+	uLong crc;
+	bool last;
+	double seconds;
+	std::future<void> done;
+
+	void deflate()
+	{
+		double begin = Seconds();
+		z_stream stream;
+		::memset(&stream, 0, sizeof(z_stream));
+		::deflateInit2(&stream, level, Z_DEFLATED,
+			-options.windowBits, options.memLevel, options.strategy);
+		if (!dictionary.empty())
+			::deflateSetDictionary(&stream, dictionary.data(), dictionary.size());
+		output.resize(::deflateBound(&stream, input.size()) + 16);
+		stream.next_in = input.data();
+		stream.avail_in = input.size();
+		int err;
+		do
+		{
+			if (stream.total_out == output.size())
+				output.resize(output.size() * 2);
+			stream.next_out = &output[stream.total_out];
+			stream.avail_out = output.size() - stream.total_out;
+			err = ::deflate(&stream, last ? Z_FINISH : Z_SYNC_FLUSH);
+		} while (last ? err == Z_OK : stream.avail_out == 0);
+		output.resize(stream.total_out);
+		::deflateEnd(&stream);
+		crc = Crc32(0, input.data(), input.size());
+		seconds = Seconds() - begin;
+	}
+};
+
+class ZipOutput
+	: public DataOutput
 {
 public:
-	ZipWritterImpl(const wstr& fname)
+	ZipOutput(DataOutput* output, ZipEntry* entry, uint64_t* offset, long begin, const ZipWritter::ItemOptions& options, ZipWritterStats* stats, ThreadPool* pool = NULL)
 	{
-		_srcOffset = 0;
-		_fileName = fname;
 		_alreadyFlush = false;
+		_entry = entry;
+		_dstOutput = output;
+		_offset = offset;
+		_stats = stats;
+		_pool = pool;
+		_cbDeflated = 0;
+		_begin = begin;
+		_method = ZipWritter::methodAuto;
+		_options = options;
+		_level = options.level == ZipWritter::levelAuto ? 6 : options.level;
+		_measuredBytes = 0;
+		_measuredSeconds = 0;
+		_streaming = false;
+		_zip64 = false;
+		::memset(&_zlibStream, 0, sizeof(z_stream));
+		if (options.method != ZipWritter::methodAuto)
+			_setMethod(options.method);
 	}
 
-	ZipWritterImpl(DataOutput* output)
+	~ZipOutput()
 	{
-		assert(output && output->seekable());
-		_srcOffset = output->position();
-		_dstOutput = output;
-		_alreadyFlush = false;
+		//
+		// blocks still out on the pool when the entry is dropped unflushed
+		//
+		for (size_t i = 0; i < _blocks.size(); i++)
+		{
+			_blocks[i]->done.wait();
+			delete _blocks[i];
+		}
 	}
 
-	~ZipWritterImpl()
+public:
+	//
+	// the local header is left to this output, which writes it once the
+	// method is settled and follows the data with a descriptor instead of
+	// seeking back
+	//
+	void setStreaming(const str& name)
 	{
-		flush();
-		FileHeaders::iterator it = _fileHeaders.begin();
-		for (; it != _fileHeaders.end(); it++)
-			delete it->second;
+		_streaming = true;
+		_zip64 = true;
+		_name = name;
+		_entry->header.generalPurposeBitFlag |= 0x08;
 	}
 
-	WeakPtr<DataOutput> addItem(const wstr& name)
+	long write(const byte *data, long len)
 	{
-		WeakPtr<DataOutput> wpItem;
-		if (name.empty())
-			return wpItem;
-		if (!_dstOutput)
-			_dstOutput = CreateFile(_fileName);
-		str path = ws2s(name);
-		_addFloders(path);
-		if (path.at(path.length() - 1) != '/')
+		long cb = 0;
+		if (_method == ZipWritter::methodAuto)
 		{
-			_flushItem();
-			wpItem = _addItem(path, false);
+			//
+			// hold back the start of the entry until there is enough of
+			// it to judge
+			//
+			cb = std::min(len, (long)(SAMPLESIZE - _sample.size()));
+			_sample.insert(_sample.end(), data, data + cb);
+			if (_sample.size() < SAMPLESIZE)
+				return len;
+			_choose();
 		}
-		return wpItem;
+		_write(data + cb, len - cb);
+		return len;
 	}
 
 	void flush()
 	{
-		if (_alreadyFlush || !_dstOutput)
+		if (_alreadyFlush)
 			return;
-		_flushItem();
-		FileHeaders::iterator it = _fileHeaders.begin();
-		for (; it != _fileHeaders.end(); it++)
-		{
-			str name = it->first;
-			CentralDirectoryFileHeader* header = it->second;
-			header->write(_dstOutput.get());
-			WriteData(_dstOutput.get(), &name[0], name.length());
-			_endOfCentralDirectory.sizeOfCentralDirectory +=
-				(sizeof(CentralDirectoryFileHeader) +
-				header->fileNameLength +
-				header->extraFieldLength +
-				header->fileCommentLength);
-			_endOfCentralDirectory.totalEntriesOnThisDisk++;
-			_endOfCentralDirectory.totalEntries++;
-		}
-		_endOfCentralDirectory.write(_dstOutput.get());
+
+		//
+		// a local header still to be written here means the whole entry
+		// is at hand, well short of 4G
+		//
+		if (!_name.empty())
+			_zip64 = false;
+		if (_method == ZipWritter::methodAuto)
+			_choose();
+		if (!_name.empty())
+			_writeLocalHeader();
+		if (_method == Z_DEFLATED && _pool)
+		{
+			_post(true);
+			while (!_blocks.empty())
+				_collect();
+		}
+		else if (_method == Z_DEFLATED)
+			_deflate(0, 0, true);
+		else if (_encoder != NULL)
+		{
+			_encoder->finish();
+			_entry->compressedSize = _encoder->written();
+		}
+
+		if (_streaming)
+			_writeDescriptor();
+		else
+			_updateLocalHeader();
+
+		if (_method == Z_DEFLATED)
+		{
+			_stats->deflatedEntries++;
+			_stats->deflatedBytes += _entry->uncompressedSize;
+			_stats->deflatedOutput += _entry->compressedSize;
+		}
+		else if (_encoder != NULL)
+		{
+			_stats->codecEntries++;
+			_stats->codecBytes += _entry->uncompressedSize;
+			_stats->codecOutput += _entry->compressedSize;
+		}
+		else
+		{
+			_stats->storedEntries++;
+			_stats->storedBytes += _entry->uncompressedSize;
+		}
+
+		::deflateEnd(&_zlibStream);
 		_alreadyFlush = true;
 	}
 
 private:
-	void _flushItem()
+	//
+	// an entry whose sizes may yet pass 4G gets a Zip64 extra with no
+	// sizes in it, which tells readers that its descriptor is 64-bit
+	//
+	void _writeLocalHeader()
 	{
-		if (_currentItem.get())
+		CentralDirectoryFileHeader* header = &_entry->header;
+		if (_zip64)
+			header->versionNeededToExtract = 45;
+		LocalFileHeader localFileHeader;
+		localFileHeader.versionNeededToExtract = header->versionNeededToExtract;
+		localFileHeader.generalPurposeBitFlag = header->generalPurposeBitFlag;
+		localFileHeader.compressionMethod = header->compressionMethod;
+		localFileHeader.fileNameLength = _name.length();
+		if (_zip64)
 		{
-			_currentItem->flush();
-			_currentItem.clear();
+			localFileHeader.compressedSize = 0xFFFFFFFF;
+			localFileHeader.uncompressedSize = 0xFFFFFFFF;
+			localFileHeader.extraFieldLength = sizeof(Zip64LocalExtra);
+		}
+		localFileHeader.write(_dstOutput);
+		WriteData(_dstOutput, &_name[0], _name.length());
+		if (_zip64)
+		{
+			Zip64LocalExtra().write(_dstOutput);
+			*_offset += sizeof(Zip64LocalExtra);
 		}
+		_name.clear();
 	}
 
-	void _addFloders(str name)
+	//
+	// 64-bit descriptor after a Zip64 local header, 32-bit otherwise; the
+	// central directory has the final word either way
+	//
+	void _writeDescriptor()
 	{
-		str folder;
-		str::size_type pos = name.find("/");
-		while (pos != str::npos)
+		CentralDirectoryFileHeader* header = &_entry->header;
+		*_offset += _entry->compressedSize;
+		if (_zip64)
+		{
+			Zip64DataDescriptor dataDescriptor;
+			dataDescriptor.crc32 = header->crc32;
+			dataDescriptor.compressedSize = _entry->compressedSize;
+			dataDescriptor.uncompressedSize = _entry->uncompressedSize;
+			dataDescriptor.write(_dstOutput);
+			*_offset += sizeof(Zip64DataDescriptor);
+		}
+		else
 		{
-			folder += name.substr(0, pos + 1);
-			_addItem(folder);
-			name = name.substr(pos + 1, name.length() - folder.length());
-			pos = name.find("/");
+			DataDescriptor dataDescriptor;
+			dataDescriptor.crc32 = header->crc32;
+			dataDescriptor.compressedSize = _entry->compressedSize;
+			dataDescriptor.uncompressedSize = _entry->uncompressedSize;
+			dataDescriptor.write(_dstOutput);
+			*_offset += sizeof(DataDescriptor);
 		}
 	}
 
-	DataOutput* _addItem(const str& name, bool floder = true)
+	void _updateLocalHeader()
 	{
-		if (_fileHeaders.find(name) != _fileHeaders.end())
-			return NULL;
-		LocalFileHeader local(floder);
-		local.fileNameLength = name.length();
-		if (!local.write(_dstOutput.get()) || !WriteData(_dstOutput.get(), &name[0], name.length()))
-			return NULL;
-		CentralDirectoryFileHeader* fileHeader = new CentralDirectoryFileHeader(floder);
-		fileHeader->fileNameLength = name.length();
-		fileHeader->relativeOffsetOfLocalHeader = _endOfCentralDirectory.startOfCentralDirectory;
-		_fileHeaders.insert(std::make_pair(str(name.begin(), name.end()), fileHeader));
-		_endOfCentralDirectory.startOfCentralDirectory +=
-			(sizeof(LocalFileHeader) + local.fileNameLength + local.extraFieldLength);
+		//
+		// update current local file header record; it has no room for
+		// sizes past 4G, those go to a Zip64 data descriptor after the
+		// data instead
+		//
+		CentralDirectoryFileHeader* header = &_entry->header;
+		bool descriptor = (_entry->compressedSize >= 0xFFFFFFFF ||
+			_entry->uncompressedSize >= 0xFFFFFFFF);
+		if (descriptor)
+		{
+			header->generalPurposeBitFlag |= 0x08;
+			header->versionNeededToExtract = 45;
+		}
+		_dstOutput->seek(_begin + _entry->offset);
+		LocalFileHeader localFileHeader;
+		localFileHeader.versionNeededToExtract = header->versionNeededToExtract;
+		localFileHeader.generalPurposeBitFlag = header->generalPurposeBitFlag;
+		if (!descriptor)
+		{
+			localFileHeader.crc32 = header->crc32;
+			localFileHeader.compressedSize = _entry->compressedSize;
+			localFileHeader.uncompressedSize = _entry->uncompressedSize;
+		}
+		localFileHeader.compressionMethod = header->compressionMethod;
+		localFileHeader.fileNameLength = header->fileNameLength;
+		localFileHeader.write(_dstOutput);
+
+		//
+		// update offset of start of central directory
+		//
+		_dstOutput->skip(header->fileNameLength + _entry->compressedSize);
+		*_offset += _entry->compressedSize;
+		if (descriptor)
+		{
+			Zip64DataDescriptor dataDescriptor;
+			dataDescriptor.crc32 = header->crc32;
+			dataDescriptor.compressedSize = _entry->compressedSize;
+			dataDescriptor.uncompressedSize = _entry->uncompressedSize;
+			dataDescriptor.write(_dstOutput);
+			*_offset += sizeof(Zip64DataDescriptor);
+		}
+	}
+
+	void _setMethod(int method)
+	{
+		_method = method;
+		_entry->header.compressionMethod = method;
+		if (method != 0 && method != Z_DEFLATED)
+			_encoder = Codec::find(method)->encoder(_dstOutput);
+		if (method != Z_DEFLATED || _pool)
+			return;
+		_buffer.resize(BUFSIZE);
+		::deflateInit2(&_zlibStream, _level, Z_DEFLATED,
+			-_options.windowBits, _options.memLevel, _options.strategy);
+		_zlibStream.next_out = (Bytef*)&_buffer[0];
+		_zlibStream.avail_out = (uInt)BUFSIZE;
+	}
+
+	void _choose()
+	{
+		_setMethod(_compressible(_sample) ? Z_DEFLATED : 0);
+		ByteArray sample;
+		sample.swap(_sample);
+		_write(sample.data(), sample.size());
+	}
+
+	//
+	// a fast deflate of the sample has to save at least a tenth, which
+	// already compressed data does not
+	//
+	static bool _compressible(const ByteArray& sample)
+	{
+		if (sample.empty())
+			return false;
+		z_stream stream;
+		::memset(&stream, 0, sizeof(z_stream));
+		if (::deflateInit2(&stream, 1, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+			return true;
+		ByteArray output(::deflateBound(&stream, sample.size()));
+		stream.next_in = (Bytef*)sample.data();
+		stream.avail_in = sample.size();
+		stream.next_out = output.data();
+		stream.avail_out = output.size();
+		::deflate(&stream, Z_FINISH);
+		uLong deflated = stream.total_out;
+		::deflateEnd(&stream);
+		return deflated * 10 < sample.size() * 9;
+	}
+
+	void _write(const byte *data, long len)
+	{
+		if (!_name.empty())
+			_writeLocalHeader();
+		if (_method == Z_DEFLATED && _pool)
+		{
+			while (len > 0)
+			{
+				long cb = std::min(len, (long)(DEFLATEBLOCK - _block.size()));
+				_block.insert(_block.end(), data, data + cb);
+				data += cb;
+				len -= cb;
+				if (_block.size() == DEFLATEBLOCK)
+					_post(false);
+			}
+			return;
+		}
+
+		//
+		// zlib counts its input in 32 bits
+		//
+		for (long done = 0; done < len; done += BLOCKSIZE)
+		{
+			uInt cb = (uInt)std::min(len - done, (long)BLOCKSIZE);
+			_entry->header.crc32 = Crc32(_entry->header.crc32, data + done, cb);
+			if (_method == Z_DEFLATED && _options.level == ZipWritter::levelAuto)
+			{
+				double begin = Seconds();
+				_deflate(data + done, cb, false);
+				_measure(cb, Seconds() - begin);
+			}
+			else if (_method == Z_DEFLATED)
+				_deflate(data + done, cb, false);
+			else if (_encoder != NULL)
+			{
+				_encoder->write(data + done, cb);
+				_entry->uncompressedSize += cb;
+			}
+			else
+			{
+				_dstOutput->write(data + done, cb);
+				_entry->compressedSize += cb;
+				_entry->uncompressedSize += cb;
+			}
+		}
+	}
+
+	void _post(bool last)
+	{
+		ZipDeflateBlock* block = new ZipDeflateBlock();
+		block->input.swap(_block);
+		block->dictionary.swap(_window);
+		block->options = _options;
+		block->level = _level;
+		block->last = last;
+		if (!last)
+		{
+			long cb = std::min((long)block->input.size(), (long)1 << _options.windowBits);
+			_window.assign(block->input.end() - cb, block->input.end());
+			_block.reserve(DEFLATEBLOCK);
+		}
+		block->done = _pool->post(std::bind(&ZipDeflateBlock::deflate, block));
+		_blocks.push_back(block);
+
+		//
+		// keep a couple of blocks per thread in flight, no more, so that
+		// memory stays bounded for any entry size
+		//
+		while (_blocks.size() > 2 * (size_t)_pool->size())
+			_collect();
+	}
+
+	void _collect()
+	{
+		ZipDeflateBlock* block = _blocks.front();
+		_blocks.pop_front();
+		block->done.wait();
+		_dstOutput->write(block->output.data(), block->output.size());
+		_entry->header.crc32 = Crc32Combine(_entry->header.crc32, block->crc, block->input.size());
+		_entry->compressedSize += block->output.size();
+		_entry->uncompressedSize += block->input.size();
+		if (_options.level == ZipWritter::levelAuto)
+			_measure(block->input.size(), block->seconds / _pool->size());
+		delete block;
+	}
+
+	//
+	// levelAuto: once ADJUSTSIZE more bytes went through, compare the rate
+	// deflate managed against the target and move the level one step
+	//
+	void _measure(long bytes, double seconds)
+	{
+		_measuredBytes += bytes;
+		_measuredSeconds += seconds;
+		if (_measuredBytes < ADJUSTSIZE)
+			return;
+		double rate = _measuredBytes / std::max(_measuredSeconds, 1e-9);
+		_measuredBytes = 0;
+		_measuredSeconds = 0;
+		int level = _level;
+		if (rate < _options.targetRate && level > 1)
+			level--;
+		else if (rate > _options.targetRate * 1.5 && level < 9)
+			level++;
+		if (level == _level)
+			return;
+
+		if (_pool)
+		{
+			_level = level;
+			return;
+		}
+
+		//
+		// zlib flushes what it holds under the old parameters into the
+		// output buffer first, and leaves them as they were when it has no
+		// room for that; the next round tries again then
+		//
+		uLong outBefore = _zlibStream.total_out;
+		if (::deflateParams(&_zlibStream, level, _options.strategy) == Z_OK)
+			_level = level;
+		_cbDeflated += (_zlibStream.total_out - outBefore);
+	}
+
+	bool _deflate(const void *pv, long cb, bool flush)
+	{
+		_zlibStream.next_in = (Bytef*)pv;
+		_zlibStream.avail_in = (uInt)cb;
+
+		bool finished = false;
+		do
+		{
+			uLong outBefore = _zlibStream.total_out;
+			int err = deflate(&_zlibStream, flush ? Z_FINISH : Z_NO_FLUSH);
+			uLong outAfter = _zlibStream.total_out;
+			_cbDeflated += (outAfter - outBefore);
+
+			if (flush || _zlibStream.avail_out == 0)
+			{
+				if (_cbDeflated > 0)
+				{
+					_dstOutput->write(&_buffer[0], _cbDeflated);
+					_entry->compressedSize += _cbDeflated;
+					_entry->uncompressedSize += _zlibStream.total_in;
+					_zlibStream.total_in = 0;
+					_cbDeflated = 0;
+				}
+				_zlibStream.next_out = (Bytef*)&_buffer[0];
+				_zlibStream.avail_out = (uInt)BUFSIZE;
+			}
+
+			if (_zlibStream.avail_in != 0 || (flush && err != Z_STREAM_END))
+				finished = false;
+			else
+				finished = true;
+
+		} while (!finished);
+
+		return true;
+	}
+
+	bool _alreadyFlush;
+	int _method;
+	int _level;
+	ZipWritter::ItemOptions _options;
+	long _measuredBytes;
+	double _measuredSeconds;
+	uint32_t _cbDeflated;
+	long _begin;
+	z_stream _zlibStream;
+	bool _streaming;
+	bool _zip64;
+	str _name;
+	DataOutput* _dstOutput;
+	ByteArray _buffer;
+	ByteArray _sample;
+	ByteArray _block;
+	ByteArray _window;
+	std::deque<ZipDeflateBlock*> _blocks;
+	ThreadPool* _pool;
+	StrongPtr<Encoder> _encoder;
+	uint64_t* _offset;
+	ZipEntry* _entry;
+	ZipWritterStats* _stats;
+};
+
+//
+// entry written off to the side, in memory until it grows past SPILLSIZE
+// and in a temp file from then on
+//
+class ZipSegment
+	: public DataOutput
+{
+public:
+	ZipSegment()
+	{
+		_pos = 0;
+		_size = 0;
+	}
+
+	~ZipSegment()
+	{
+		_file.clear();
+		if (!_path.empty())
+			RemoveFile(_path);
+	}
+
+public:
+	long write(const byte *data, long len)
+	{
+		if (_file == NULL && _pos + len > SPILLSIZE)
+			_spill();
+		if (_file != NULL)
+		{
+			len = _file->write(data, len);
+			if (len < 0)
+				return -1;
+		}
+		else
+		{
+			if (_pos + len > (long)_bytes.size())
+				_bytes.resize(_pos + len);
+			::memcpy(&_bytes[_pos], data, len);
+		}
+		_pos += len;
+		_size = std::max(_size, _pos);
+		return len;
+	}
+
+	long seek(long pos, int whence = SEEK_SET)
+	{
+		if (whence == SEEK_CUR)
+			pos += _pos;
+		else if (whence == SEEK_END)
+			pos += _size;
+		if (pos < 0 || (_file != NULL && _file->seek(pos) == -1))
+			return -1;
+		_pos = pos;
+		return _pos;
+	}
+
+	long skip(long n)
+	{
+		return seek(n, SEEK_CUR);
+	}
+
+	long position() const
+	{
+		return _pos;
+	}
+
+	bool seekable() const
+	{
+		return true;
+	}
+
+	long size() const
+	{
+		return _size;
+	}
+
+	bool copyTo(DataOutput* output)
+	{
+		if (_file == NULL)
+			return WriteData(output, _bytes.data(), _bytes.size());
+		_file.clear();
+		StrongPtr<DataInput> input = OpenFile(_path);
+		if (input == NULL)
+			return false;
+		ByteArray buffer(BUFSIZE * 16);
+		long total = 0;
+		long cb;
+		while ((cb = input->read(&buffer[0], buffer.size())) > 0)
+		{
+			if (output->write(&buffer[0], cb) != cb)
+				return false;
+			total += cb;
+		}
+		return (total == _size);
+	}
+
+private:
+	void _spill()
+	{
+		_file = CreateTempFile(_path);
+		if (_file != NULL &&
+			_file->write(_bytes.data(), _bytes.size()) == (long)_bytes.size() &&
+			_file->seek(_pos) == _pos)
+		{
+			ByteArray().swap(_bytes);
+			return;
+		}
+
+		//
+		// no temp file to be had, stay in memory
+		//
+		_file.clear();
+		if (!_path.empty())
+			RemoveFile(_path);
+		_path.clear();
+	}
+
+	long _pos;
+	long _size;
+	ByteArray _bytes;
+	StrongPtr<DataOutput> _file;
+	wstr _path;
+};
+
+//
+// every name a writter has taken, for duplicate and folder checks: each
+// one once in an arena of fixed chunks behind its 16-bit length, found
+// through an open-addressing table of arena offsets plus one (zero when
+// empty); it never spills, unlike the directory log
+//
+class ZipNameSet
+{
+public:
+	ZipNameSet()
+	{
+		_count = 0;
+		_slots.resize(1024);
+	}
+
+public:
+	//
+	// false if name is there already or too long for a zip header
+	//
+	bool add(const char* name, uint32_t length)
+	{
+		if (length > 0xFFFF)
+			return false;
+		if ((_count + 1) * 2 > _slots.size())
+			_grow();
+		uint64_t* slot = _find(name, length);
+		if (*slot != 0)
+			return false;
+		if (_arena.empty() || _arena.back().size() + 2 + length > CHUNKSIZE)
+		{
+			_arena.push_back(std::vector<char>());
+			_arena.back().reserve(CHUNKSIZE);
+		}
+		std::vector<char>& chunk = _arena.back();
+		*slot = (_arena.size() - 1) * CHUNKSIZE + chunk.size() + 1;
+		chunk.push_back((char)(length & 0xFF));
+		chunk.push_back((char)(length >> 8));
+		chunk.insert(chunk.end(), name, name + length);
+		_count++;
+		return true;
+	}
+
+	bool contains(const char* name, uint32_t length)
+	{
+		return *_find(name, length) != 0;
+	}
+
+private:
+	uint64_t* _find(const char* name, uint32_t length)
+	{
+		uint64_t mask = _slots.size() - 1;
+		uint64_t i = hash(name, length) & mask;
+		while (_slots[i] != 0 && !_equals(_slots[i] - 1, name, length))
+			i = (i + 1) & mask;
+		return &_slots[i];
+	}
+
+	const byte* _at(uint64_t offset) const
+	{
+		return (const byte*)&_arena[offset / CHUNKSIZE][offset % CHUNKSIZE];
+	}
+
+	bool _equals(uint64_t offset, const char* name, uint32_t length) const
+	{
+		const byte* p = _at(offset);
+		return (uint32_t)(p[0] | (p[1] << 8)) == length &&
+			::memcmp(p + 2, name, length) == 0;
+	}
+
+	void _grow()
+	{
+		std::vector<uint64_t> slots(_slots.size() * 2);
+		_slots.swap(slots);
+		for (size_t i = 0; i < slots.size(); i++)
+		{
+			if (slots[i] == 0)
+				continue;
+			const byte* p = _at(slots[i] - 1);
+			*_find((const char*)p + 2, p[0] | (p[1] << 8)) = slots[i];
+		}
+	}
+
+	uint64_t _count;
+	std::vector<std::vector<char> > _arena;
+	std::vector<uint64_t> _slots;
+};
+
+//
+// central directory records of the entries written so far, in the order
+// their data went out and already as they go on disk; held in fixed
+// chunks, or once spilling and past SPILLSIZE, in a temp file
+//
+class ZipDirectoryLog
+{
+public:
+	ZipDirectoryLog()
+	{
+		_count = 0;
+		_size = 0;
+		_spilling = false;
+		_failed = 0;
+	}
+
+	~ZipDirectoryLog()
+	{
+		_file.clear();
+		if (!_path.empty())
+			RemoveFile(_path);
+	}
+
+public:
+	//
+	// other holds extra fields that go along with the record, those of an
+	// entry carried over from the archive appended to; a Zip64 block
+	// among them is stale and left out for the one narrow() writes
+	//
+	void add(ZipEntry& entry, const str& name, const byte* other = NULL, uint16_t otherLength = 0)
+	{
+		byte extra[28];
+		uint16_t extraLength = entry.narrow(extra);
+		ByteArray kept;
+		while (otherLength >= 4)
+		{
+			uint32_t size = 4 + (other[2] | (other[3] << 8));
+			if (size > otherLength)
+				break;
+			if ((other[0] | (other[1] << 8)) != 0x0001)
+				kept.insert(kept.end(), other, other + size);
+			other += size;
+			otherLength -= size;
+		}
+		if (extraLength + kept.size() > 0xFFFF)
+			kept.clear();
+		entry.header.extraFieldLength = extraLength + kept.size();
+		entry.header.fileNameLength = name.length();
+		entry.header.fileCommentLength = 0;
+		uint64_t length = sizeof(CentralDirectoryFileHeader) + name.length() + entry.header.extraFieldLength;
+		if (_pending.size() + length > CHUNKSIZE)
+			_drain();
+		if (_pending.capacity() < CHUNKSIZE)
+			_pending.reserve(CHUNKSIZE);
+		_append(&entry.header, sizeof(CentralDirectoryFileHeader));
+		_append(name.data(), name.length());
+		_append(extra, extraLength);
+		_append(kept.data(), kept.size());
+		_size += length;
+		_count++;
+	}
+
+	bool copyTo(DataOutput* output)
+	{
+		_drain();
+		if (!good())
+			return false;
+		for (size_t i = 0; i < _chunks.size(); i++)
+		{
+			if (!WriteData(output, _chunks[i].data(), _chunks[i].size()))
+				return false;
+		}
+		if (_file == NULL)
+			return true;
+		_file.clear();
+		StrongPtr<DataInput> input = OpenFile(_path);
+		if (input == NULL)
+			return false;
+		ByteArray buffer(COPYSIZE);
+		long cb;
+		while ((cb = input->read(&buffer[0], buffer.size())) > 0)
+		{
+			if (output->write(&buffer[0], cb) != cb)
+				return false;
+		}
+		return cb == 0;
+	}
+
+	void setSpill(bool spill)
+	{
+		_spilling = spill;
+	}
+
+	uint64_t size() const
+	{
+		return _size;
+	}
+
+	uint64_t count() const
+	{
+		return _count;
+	}
+
+	//
+	// false once records were lost on their way to the temp file
+	//
+	bool good() const
+	{
+		return atomic_load(&_failed) == 0;
+	}
+
+private:
+	void _append(const void* data, size_t length)
+	{
+		const byte* p = (const byte*)data;
+		_pending.insert(_pending.end(), p, p + length);
+	}
+
+	void _drain()
+	{
+		if (_pending.empty())
+			return;
+		if (_file == NULL && _spilling && (_chunks.size() + 1) * CHUNKSIZE > SPILLSIZE)
+			_spill();
+		if (_file != NULL)
+		{
+			if (!WriteData(_file.get(), _pending.data(), _pending.size()))
+				atomic_store(1, &_failed);
+			_pending.clear();
+			return;
+		}
+		_chunks.push_back(ByteArray());
+		_chunks.back().swap(_pending);
+	}
+
+	//
+	// the chunks so far go first, everything after straight to the file;
+	// without a temp file the log stays in memory
+	//
+	void _spill()
+	{
+		_file = CreateTempFile(_path);
+		for (size_t i = 0; _file != NULL && i < _chunks.size(); i++)
+		{
+			if (!WriteData(_file.get(), _chunks[i].data(), _chunks[i].size()))
+				_file.clear();
+		}
+		if (_file != NULL)
+		{
+			std::vector<ByteArray>().swap(_chunks);
+			return;
+		}
+		if (!_path.empty())
+			RemoveFile(_path);
+		_path.clear();
+		_spilling = false;
+	}
+
+	bool _spilling;
+	volatile int32_t _failed;
+	uint64_t _count;
+	uint64_t _size;
+	ByteArray _pending;
+	std::vector<ByteArray> _chunks;
+	StrongPtr<DataOutput> _file;
+	wstr _path;
+};
+
+//
+// item of a concurrent writter, compressed into its own segment on the
+// thread that writes it; flush() hands the segment over to be appended
+//
+class ZipConcurrentItem
+	: public DataOutput
+{
+public:
+	typedef std::function<void(ZipConcurrentItem*)> Done;
+
+	ZipConcurrentItem(ZipSegment* segment, const ZipEntry& entry, const str& name, const ZipWritter::ItemOptions& options, ThreadPool* pool, const Done& done)
+	{
+		_segment = segment;
+		_entry = entry;
+		_name = name;
+		_length = segment->size();
+		_flushed = false;
+		_done = done;
+		::memset(&_stats, 0, sizeof(_stats));
+		_output = new ZipOutput(segment, &_entry, &_length, 0, options, &_stats, pool);
+	}
+
+	~ZipConcurrentItem()
+	{
+		_output.clear();
+		_segment.clear();
+	}
+
+public:
+	long write(const byte *data, long len)
+	{
+		if (_flushed)
+			return -1;
+		return _output->write(data, len);
+	}
+
+	void flush()
+	{
+		if (_flushed)
+			return;
+		_flushed = true;
+		_output->flush();
+		_done(this);
+	}
+
+	ZipSegment* segment()
+	{
+		return _segment.get();
+	}
+
+	const ZipEntry& entry() const
+	{
+		return _entry;
+	}
+
+	const str& name() const
+	{
+		return _name;
+	}
+
+	const ZipWritterStats& stats() const
+	{
+		return _stats;
+	}
+
+private:
+	bool _flushed;
+	uint64_t _length;
+	ZipEntry _entry;
+	str _name;
+	ZipWritterStats _stats;
+	StrongPtr<ZipSegment> _segment;
+	StrongPtr<ZipOutput> _output;
+	Done _done;
+};
+
+class ZipWritterImpl
+	: public ZipWritter
+{
+public:
+	ZipWritterImpl(const wstr& fname)
+	{
+		_srcOffset = 0;
+		_offset = 0;
+		_fileName = fname;
+		_alreadyFlush = false;
+		_indexed = false;
+		_concurrent = false;
+		_streaming = false;
+		_appended = false;
+		_failed = 0;
+		::memset(&_stats, 0, sizeof(_stats));
+	}
+
+	ZipWritterImpl(DataOutput* output)
+	{
+		assert(output);
+		_streaming = !output->seekable();
+		_srcOffset = _streaming ? 0 : output->position();
+		_offset = 0;
+		_dstOutput = output;
+		_alreadyFlush = false;
+		_indexed = false;
+		_concurrent = false;
+		_appended = false;
+		_failed = 0;
+		::memset(&_stats, 0, sizeof(_stats));
+	}
+
+	~ZipWritterImpl()
+	{
+		flush();
+	}
+
+	//
+	// an entry of the archive appended to, taken over as it is with the
+	// extra fields of its record; false if its name came up before
+	//
+	bool adopt(const str& name, ZipEntry& entry, const byte* extra, uint16_t length)
+	{
+		if (!_names.add(name.data(), name.length()))
+			return false;
+		_directory.add(entry, name, extra, length);
+		return true;
+	}
+
+	//
+	// picks up after the adopted entries, from the start of the central
+	// directory they came from on
+	//
+	void resume(DataOutput* output, uint64_t offset)
+	{
+		_offset = offset;
+		_dstOutput = output;
+		_dstOutput->seek(offset);
+		_appended = true;
+	}
+
+	using ZipWritter::addItem;
+
+	WeakPtr<DataOutput> addItem(const wstr& name, const ItemOptions& options)
+	{
+		WeakPtr<DataOutput> wpItem;
+		if (name.empty() || !_validOptions(options))
+			return wpItem;
+		std::unique_lock<std::mutex> lock(_mutex, std::defer_lock);
+		if (_concurrent)
+			lock.lock();
+		if (!_dstOutput)
+		{
+			_dstOutput = CreateFile(_fileName);
+			_streaming = _streaming || !_dstOutput->seekable();
+		}
+		str path = ws2s(name);
+		_flushItem();
+		_addFloders(path);
+		if (path.at(path.length() - 1) != '/')
+			wpItem = _addItem(path, false, options);
+		return wpItem;
+	}
+
+	bool copyRaw(ZipReader* reader, const wstr& name)
+	{
+		ZipRawEntry raw;
+		StrongPtr<DataInput> input = reader ? reader->rawItem(name, raw) : NULL;
+		return input != NULL && _copyRaw(name, input.get(), raw);
+	}
+
+	long copyRaw(ZipReader* reader, const std::vector<wstr>& names)
+	{
+		if (!reader)
+			return 0;
+
+		//
+		// one pass front to back over the source however names are ordered
+		//
+		std::vector<ZipRawEntry> raws(names.size());
+		std::vector<StrongPtr<DataInput> > inputs(names.size());
+		std::vector<std::pair<uint64_t, size_t> > order;
+		for (size_t i = 0; i < names.size(); i++)
+		{
+			inputs[i] = reader->rawItem(names[i], raws[i]);
+			if (inputs[i] != NULL)
+				order.push_back(std::make_pair(raws[i].offset, i));
+		}
+		std::sort(order.begin(), order.end());
+		long count = 0;
+		for (size_t i = 0; i < order.size(); i++)
+		{
+			size_t n = order[i].second;
+			if (_copyRaw(names[n], inputs[n].get(), raws[n]))
+				count++;
+			inputs[n].clear();
+		}
+		return count;
+	}
+
+	void flush()
+	{
+		if (_alreadyFlush || !_dstOutput)
+			return;
+		_flushItem();
+		_flushConcurrent();
+		_alreadyFlush = true;
+		if (!good())
+			return;
+		if (!_directory.copyTo(_dstOutput.get()) ||
+			!_writeEndOfCentralDirectory(_offset, _directory.size(), _directory.count()))
+		{
+			atomic_store(1, &_failed);
+			return;
+		}
+
+		//
+		// the archive appended to may have run on past the new end
+		//
+		if (_appended)
+			TruncateFile(_fileName, _dstOutput->position());
+
+		//
+		// the records are not kept around, the index is built from the
+		// central directory just written
+		//
+		if (_indexed && !_fileName.empty() && !_streaming)
+			ZipReader::buildIndex(_fileName);
+	}
+
+	void setIndexed(bool indexed)
+	{
+		_indexed = indexed;
+	}
+
+	void setSpilling(bool spilling)
+	{
+		_directory.setSpill(spilling);
+	}
+
+	bool good()
+	{
+		return atomic_load(&_failed) == 0 && _directory.good();
+	}
+
+	ZipWritterStats stats()
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		return _stats;
+	}
+
+	void setConcurrent(bool concurrent)
+	{
+		_concurrent = concurrent;
+	}
+
+	void setStreaming(bool streaming)
+	{
+		_streaming = streaming || (_dstOutput != NULL && !_dstOutput->seekable());
+	}
+
+	void setThreads(int threads)
+	{
+		if (threads <= 0)
+			threads = std::max(1, (int)std::thread::hardware_concurrency());
+		_pool.clear();
+		if (threads > 1)
+			_pool = ThreadPool::create(threads);
+	}
+
+private:
+	static bool _validOptions(const ItemOptions& options)
+	{
+		return (options.method == methodStored ||
+				options.method == methodDeflated ||
+				options.method == methodAuto ||
+				Codec::find(options.method) != NULL) &&
+			((options.level >= Z_DEFAULT_COMPRESSION && options.level <= Z_BEST_COMPRESSION) ||
+				(options.level == levelAuto && options.targetRate > 0)) &&
+			options.memLevel >= 1 && options.memLevel <= MAX_MEM_LEVEL &&
+			options.windowBits >= 9 && options.windowBits <= MAX_WBITS &&
+			options.strategy >= Z_DEFAULT_STRATEGY && options.strategy <= Z_FIXED;
+	}
+
+	//
+	// a Zip64 record and its locator go in front of the classic record once
+	// one of its fields overflows, the classic one is saturated then
+	//
+	bool _writeEndOfCentralDirectory(uint64_t start, uint64_t size, uint64_t entries)
+	{
+		if (entries >= 0xFFFF || start >= 0xFFFFFFFF || size >= 0xFFFFFFFF)
+		{
+			Zip64EndOfCentralDirectory zip64EndOfCentralDirectory;
+			zip64EndOfCentralDirectory.totalEntriesOnThisDisk = entries;
+			zip64EndOfCentralDirectory.totalEntries = entries;
+			zip64EndOfCentralDirectory.sizeOfCentralDirectory = size;
+			zip64EndOfCentralDirectory.startOfCentralDirectory = start;
+			Zip64EndOfCentralDirectoryLocator zip64Locator;
+			zip64Locator.relativeOffsetOfCentralDirectory = start + size;
+			if (!zip64EndOfCentralDirectory.write(_dstOutput.get()) ||
+				!zip64Locator.write(_dstOutput.get()))
+				return false;
+		}
+		_endOfCentralDirectory.totalEntriesOnThisDisk = std::min(entries, (uint64_t)0xFFFF);
+		_endOfCentralDirectory.totalEntries = std::min(entries, (uint64_t)0xFFFF);
+		_endOfCentralDirectory.sizeOfCentralDirectory = std::min(size, (uint64_t)0xFFFFFFFF);
+		_endOfCentralDirectory.startOfCentralDirectory = std::min(start, (uint64_t)0xFFFFFFFF);
+		return _endOfCentralDirectory.write(_dstOutput.get());
+	}
+
+	void _flushConcurrent()
+	{
+		std::vector<StrongPtr<ZipConcurrentItem> > items;
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			ConcurrentItems::iterator it = _concurrentItems.begin();
+			for (; it != _concurrentItems.end(); it++)
+				items.push_back(it->second);
+		}
+		for (size_t i = 0; i < items.size(); i++)
+			items[i]->flush();
+
+		//
+		// dropping the serializer waits for what it still has queued
+		//
+		_serializer.clear();
+	}
+
+	void _flushItem()
+	{
+		if (_currentItem.get())
+		{
+			_currentItem->flush();
+			_currentItem.clear();
+			_directory.add(_currentEntry, _currentName);
+		}
+	}
+
+	//
+	// the folders above name not taken yet, outermost first; one that is
+	// there has its parents too, so the search runs from the innermost
+	// folder outwards and stops at the first one found
+	//
+	void _addFloders(const str& name)
+	{
+		str::size_type known = 0;
+		str::size_type pos = name.rfind('/');
+		while (pos != str::npos)
+		{
+			if (_names.contains(name.data(), pos + 1))
+			{
+				known = pos + 1;
+				break;
+			}
+			pos = pos > 0 ? name.rfind('/', pos - 1) : str::npos;
+		}
+		for (pos = name.find('/', known); pos != str::npos; pos = name.find('/', pos + 1))
+			_addItem(name.substr(0, pos + 1));
+	}
+
+	DataOutput* _addItem(const str& name, bool floder = true, const ItemOptions& options = ItemOptions(methodStored))
+	{
+		if (!_names.add(name.data(), name.length()))
+			return NULL;
+		if (_concurrent)
+			return _addConcurrentItem(name, floder, options);
+
+		//
+		// streamed entries write their own local header once the method
+		// is known, folders have nothing to wait for
+		//
+		bool streamed = _streaming && !floder;
+		LocalFileHeader local(floder);
+		local.fileNameLength = name.length();
+		if (!streamed && (!local.write(_dstOutput.get()) || !WriteData(_dstOutput.get(), &name[0], name.length())))
+		{
+			atomic_store(1, &_failed);
+			return NULL;
+		}
+		ZipEntry entry(floder);
+		entry.header.fileNameLength = name.length();
+		entry.offset = _offset;
+		_offset += (sizeof(LocalFileHeader) + local.fileNameLength + local.extraFieldLength);
+		if (floder)
+		{
+			_directory.add(entry, name);
+			return NULL;
+		}
+
+		//
+		// the item writes its sizes and CRC straight into the entry, which
+		// goes to the directory when the item is flushed
+		//
+		_currentEntry = entry;
+		_currentName = name;
+		_currentItem = new ZipOutput(_dstOutput.get(), &_currentEntry, &_offset, _srcOffset, options, &_stats, _pool.get());
+		if (streamed)
+			_currentItem->setStreaming(name);
+		return _currentItem.get();
+	}
+
+	//
+	// the entry is built in a segment of its own while others are open
+	// too; a single serializer thread appends finished segments to the
+	// archive and only then learns their offset
+	//
+	DataOutput* _addConcurrentItem(const str& name, bool floder, const ItemOptions& options)
+	{
+		StrongPtr<ZipSegment> segment = new ZipSegment();
+		LocalFileHeader local(floder);
+		local.fileNameLength = name.length();
+		if (!local.write(segment.get()) || !WriteData(segment.get(), &name[0], name.length()))
+			return NULL;
+		ZipEntry entry(floder);
+		entry.header.fileNameLength = name.length();
+		if (!_serializer)
+			_serializer = ThreadPool::create(1);
 		if (floder)
+		{
+			_serializer->post(std::bind(&ZipWritterImpl::_append, this, segment, entry, name));
+			return NULL;
+		}
+		StrongPtr<ZipConcurrentItem> item = new ZipConcurrentItem(segment.get(), entry, name, options, _pool.get(),
+			std::bind(&ZipWritterImpl::_submit, this, std::placeholders::_1));
+		_concurrentItems.insert(std::make_pair(item.get(), item));
+		return item.get();
+	}
+
+	void _submit(ZipConcurrentItem* item)
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		const ZipWritterStats& stats = item->stats();
+		_stats.storedEntries += stats.storedEntries;
+		_stats.storedBytes += stats.storedBytes;
+		_stats.deflatedEntries += stats.deflatedEntries;
+		_stats.deflatedBytes += stats.deflatedBytes;
+		_stats.deflatedOutput += stats.deflatedOutput;
+		_stats.codecEntries += stats.codecEntries;
+		_stats.codecBytes += stats.codecBytes;
+		_stats.codecOutput += stats.codecOutput;
+		_serializer->post(std::bind(&ZipWritterImpl::_append, this,
+			StrongPtr<ZipSegment>(item->segment()), item->entry(), item->name()));
+		_concurrentItems.erase(item);
+	}
+
+	//
+	// an entry whose data did not get out whole is not listed, and the
+	// writter is failed
+	//
+	void _append(StrongPtr<ZipSegment> segment, ZipEntry entry, const str& name)
+	{
+		entry.offset = _offset;
+		bool copied = segment->copyTo(_dstOutput.get());
+		_offset += segment->size();
+		if (!copied)
+		{
+			atomic_store(1, &_failed);
+			return;
+		}
+		_directory.add(entry, name);
+	}
+
+	bool _copyRaw(const wstr& name, DataInput* input, const ZipRawEntry& raw)
+	{
+		if (name.empty())
+			return false;
+		std::unique_lock<std::mutex> lock(_mutex, std::defer_lock);
+		if (_concurrent)
+			lock.lock();
+		if (!_dstOutput)
+		{
+			_dstOutput = CreateFile(_fileName);
+			_streaming = _streaming || !_dstOutput->seekable();
+		}
+		str path = ws2s(name);
+		_flushItem();
+		_addFloders(path);
+		if (path.at(path.length() - 1) == '/')
+			return true;
+		if (_names.contains(path.data(), path.length()))
+			return false;
+
+		ZipEntry entry;
+		entry.header.versionNeededToExtract = raw.versionNeeded;
+		entry.header.generalPurposeBitFlag = raw.flags & ~0x08;
+		entry.header.compressionMethod = raw.method;
+		entry.header.lastModFileDateTime = raw.modified;
+		entry.header.crc32 = raw.crc32;
+		entry.header.externalFileAttributes = raw.attributes;
+		entry.header.fileNameLength = path.length();
+		entry.compressedSize = raw.compressedSize;
+		entry.uncompressedSize = raw.uncompressedSize;
+
+		//
+		// the serializer owns the output while items are open, the copy
+		// waits its turn there so that how it went can be told
+		//
+		bool copied = false;
+		if (_concurrent)
+		{
+			if (!_serializer)
+				_serializer = ThreadPool::create(1);
+			_serializer->post(std::bind(&ZipWritterImpl::_appendRawTo, this, input, entry, path, &copied)).wait();
+		}
+		else
+			copied = _appendRaw(input, entry, path);
+		if (!copied)
+			return false;
+		_names.add(path.data(), path.length());
+		_stats.copiedEntries++;
+		_stats.copiedBytes += raw.compressedSize;
+		return true;
+	}
+
+	//
+	// the sizes are known before the data here, so the local header goes
+	// out final and nothing is sought back to, streaming or not; past 4G
+	// they go to a Zip64 extra of the local header
+	//
+	void _appendRawTo(DataInput* input, ZipEntry entry, const str& name, bool* copied)
+	{
+		*copied = _appendRaw(input, entry, name);
+	}
+
+	bool _appendRaw(DataInput* input, ZipEntry entry, const str& name)
+	{
+		CentralDirectoryFileHeader* header = &entry.header;
+		bool zip64 = (entry.compressedSize >= 0xFFFFFFFF ||
+			entry.uncompressedSize >= 0xFFFFFFFF);
+		if (zip64)
+			header->versionNeededToExtract = 45;
+		LocalFileHeader localFileHeader;
+		localFileHeader.versionNeededToExtract = header->versionNeededToExtract;
+		localFileHeader.generalPurposeBitFlag = header->generalPurposeBitFlag;
+		localFileHeader.compressionMethod = header->compressionMethod;
+		localFileHeader.lastModFileDateTime = header->lastModFileDateTime;
+		localFileHeader.crc32 = header->crc32;
+		localFileHeader.compressedSize = zip64 ? 0xFFFFFFFF : (uint32_t)entry.compressedSize;
+		localFileHeader.uncompressedSize = zip64 ? 0xFFFFFFFF : (uint32_t)entry.uncompressedSize;
+		localFileHeader.fileNameLength = name.length();
+		localFileHeader.extraFieldLength = zip64 ? sizeof(Zip64LocalExtra) : 0;
+		Zip64LocalExtra extra;
+		extra.uncompressedSize = entry.uncompressedSize;
+		extra.compressedSize = entry.compressedSize;
+		entry.offset = _offset;
+		if (!localFileHeader.write(_dstOutput.get()) ||
+			!WriteData(_dstOutput.get(), &name[0], name.length()) ||
+			(zip64 && !extra.write(_dstOutput.get())))
+			return false;
+		_offset += sizeof(LocalFileHeader) + name.length() + localFileHeader.extraFieldLength;
+
+		ByteArray buffer(std::min(entry.compressedSize, (uint64_t)COPYSIZE));
+		uint64_t rest = entry.compressedSize;
+		while (rest > 0)
+		{
+			long cb = input->read(&buffer[0], (long)std::min(rest, (uint64_t)buffer.size()));
+			if (cb <= 0 || _dstOutput->write(&buffer[0], cb) != cb)
+				return false;
+			_offset += cb;
+			rest -= cb;
+		}
+		_directory.add(entry, name);
+		return true;
+	}
+
+private:
+	typedef std::map<ZipConcurrentItem*, StrongPtr<ZipConcurrentItem> > ConcurrentItems;
+	bool _alreadyFlush;
+	bool _indexed;
+	bool _concurrent;
+	bool _streaming;
+	bool _appended;
+	volatile int32_t _failed;
+	long _srcOffset;
+	uint64_t _offset;
+	ZipWritterStats _stats;
+	EndOfCentralDirectory _endOfCentralDirectory;
+	ZipNameSet _names;
+	ZipDirectoryLog _directory;
+	ZipEntry _currentEntry;
+	str _currentName;
+	StrongPtr<ZipOutput> _currentItem;
+	StrongPtr<ThreadPool> _pool;
+	StrongPtr<ThreadPool> _serializer;
+	ConcurrentItems _concurrentItems;
+	std::mutex _mutex;
+	StrongPtr<DataOutput> _dstOutput;
+	wstr _fileName;
+};
+//
+// inflate restart points of one deflated entry, shared by every ZipInput
+// opened on it; a point keeps the compressed offset of a block boundary,
+// the bits of the boundary byte still unused and the last 32K of output
+//
+class ZipAccessPoints
+	: public Refable
+{
+public:
+	struct Point
+	{
+		uint64_t out;
+		uint64_t in;
+		int bits;
+		ByteArray window;
+	};
+
+	ZipAccessPoints(long span)
+	{
+		_span = span;
+		_complete = false;
+	}
+
+public:
+	long span() const
+	{
+		return _span;
+	}
+
+	bool complete()
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		return _complete;
+	}
+
+	void finish()
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_complete = true;
+	}
+
+	uint64_t next()
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		return (_points.empty() ? 0 : _points.back().out) + _span;
+	}
+
+	void add(uint64_t out, uint64_t in, int bits, z_stream* stream)
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		if (!_points.empty() && _points.back().out >= out)
+			return;
+		_points.push_back(Point());
+		Point& point = _points.back();
+		point.out = out;
+		point.in = in;
+		point.bits = bits;
+		point.window.resize(1 << MAX_WBITS);
+		uInt length = point.window.size();
+		::inflateGetDictionary(stream, &point.window[0], &length);
+		point.window.resize(length);
+	}
+
+	//
+	// last point at or before pos, points never move once added
+	//
+	const Point* find(uint64_t pos)
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		const Point* found = NULL;
+		size_t lo = 0;
+		size_t hi = _points.size();
+		while (lo < hi)
+		{
+			size_t mid = (lo + hi) / 2;
+			if (_points[mid].out <= pos)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		if (lo > 0)
+			found = &_points[lo - 1];
+		return found;
+	}
+
+private:
+	std::mutex _mutex;
+	long _span;
+	bool _complete;
+	std::deque<Point> _points;
+};
+
+//
+// double buffered compressed input of one entry: while the caller
+// inflates one window a pool thread reads the next one
+//
+class ZipReadAhead
+	: public Refable
+{
+public:
+	//
+	// extent is the size of the compressed data, no window needs more;
+	// data that fits one window has nothing to overlap its read with
+	// and is read in place
+	//
+	ZipReadAhead(DataInput* input, ThreadPool* pool, long window, uint64_t extent)
+	{
+		_srcInput = input;
+		_pool = pool;
+		_window = (long)std::min((uint64_t)window, extent);
+		_single = extent <= (uint64_t)window;
+		_current = 0;
+		_next = 0;
+		_end = 0;
+		_filled[0] = 0;
+		_filled[1] = 0;
+	}
+
+	~ZipReadAhead()
+	{
+		_wait(0);
+		_wait(1);
+		_srcInput.clear();
+		_pool.clear();
+	}
+
+public:
+	//
+	// input from pos up to end, the first window is asked for right away
+	//
+	void start(uint64_t pos, uint64_t end)
+	{
+		_wait(0);
+		_wait(1);
+		_next = pos;
+		_end = end;
+		_current = 0;
+		_fetch(0);
+	}
+
+	//
+	// the window after the last one handed out, which stays valid until
+	// the next call; the one after it is read meanwhile
+	//
+	long next(const byte*& data)
+	{
+		int i = _current;
+		_wait(i);
+		_current = 1 - i;
+		_fetch(_current);
+		data = _buffers[i].data();
+		return _filled[i];
+	}
+
+private:
+	void _fetch(int i)
+	{
+		long cb = (long)std::min((uint64_t)_window, _end - std::min(_next, _end));
+		_filled[i] = 0;
+		if (cb == 0)
+			return;
+		if (_buffers[i].size() < (size_t)cb)
+			_buffers[i].resize(cb);
+		if (_single)
+			_read(i, _next, cb);
+		else
+			_pending[i] = _pool->post(std::bind(&ZipReadAhead::_read, this, i, _next, cb));
+		_next += cb;
+	}
+
+	void _read(int i, uint64_t pos, long cb)
+	{
+		_filled[i] = _srcInput->readAt(pos, &_buffers[i][0], cb);
+	}
+
+	void _wait(int i)
+	{
+		if (_pending[i].valid())
+			_pending[i].get();
+	}
+
+	StrongPtr<DataInput> _srcInput;
+	StrongPtr<ThreadPool> _pool;
+	long _window;
+	bool _single;
+	int _current;
+	uint64_t _next;
+	uint64_t _end;
+	ByteArray _buffers[2];
+	long _filled[2];
+	std::future<void> _pending[2];
+};
+
+class ZipInput
+	: public DataInput
+{
+public:
+	ZipInput(DataInput* input, const ZipEntry& entry, uint64_t begin, ZipAccessPoints* points = NULL, bool verify = true, ZipReadAhead* readAhead = NULL)
+	{
+		_srcInput = input;
+		_begin = begin;
+		_entry = entry;
+		_points = points;
+		_verify = verify;
+		_readAhead = readAhead;
+		_buffer.resize(BUFSIZE);
+		::memset(&_zlibStream, 0, sizeof(z_stream));
+		::inflateInit2(&_zlibStream, -MAX_WBITS);
+		_restart(NULL);
+	}
+
+	~ZipInput()
+	{
+		::inflateEnd(&_zlibStream);
+		_readAhead.clear();
+		_srcInput.clear();
+		_points.clear();
+	}
+
+public:
+	long read(byte *data, long len)
+	{
+		long cb = _read(data, len);
+
+		//
+		// a stream that ends short of the size in the directory is as
+		// broken as one with a wrong CRC
+		//
+		if (cb == 0 && len > 0 && _restUnCompressed != 0 && _verify)
+			return -1;
+		if (cb > 0 && _checking)
+		{
+			//
+			// only while everything from the start went through here
+			//
+			_crc = Crc32(_crc, data, cb);
+			if (_restUnCompressed == 0 && _crc != _entry.header.crc32)
+				return -1;
+		}
+		return cb;
+	}
+
+	long seek(long pos, int whence = SEEK_SET)
+	{
+		if (whence == SEEK_CUR)
+			pos += _position;
+		else if (whence == SEEK_END)
+			pos += _entry.uncompressedSize;
+		if (pos < 0 || pos > (long)_entry.uncompressedSize)
+			return -1;
+		if (_entry.header.compressionMethod == 0)
+		{
+			if (pos == 0)
+				_crc = 0;
+			_checking = _verify && (pos == 0 || (_checking && (uint64_t)pos == _position));
+			_position = pos;
+			_restUnCompressed = _entry.uncompressedSize - _position;
+			return _position;
+		}
+		if (_decoder != NULL && (uint64_t)pos < _position)
+			_restart(NULL);
+
+		//
+		// restart from the closest access point unless reading on from
+		// the current position gets there sooner
+		//
+		const ZipAccessPoints::Point* point = _points != NULL ? _points->find(pos) : NULL;
+		if ((uint64_t)pos < _position || (point && point->out > _position))
+			_restart(point);
+		ByteArray scratch;
+		while (_position < (uint64_t)pos)
+		{
+			scratch.resize(std::min((long)(pos - _position), (long)BUFSIZE * 16));
+			if (read(&scratch[0], scratch.size()) <= 0)
+				return -1;
+		}
+		return _position;
+	}
+
+	long skip(long n)
+	{
+		return seek(n, SEEK_CUR);
+	}
+
+	long position() const
+	{
+		return _position;
+	}
+
+	bool seekable() const
+	{
+		return true;
+	}
+
+	long size() const
+	{
+		return _entry.uncompressedSize;
+	}
+
+private:
+	long _read(byte *data, long len)
+	{
+		if (_entry.header.compressionMethod == 0)
+			return _readStored(data, len);
+		if (_decoder != NULL)
+			return _readDecoded(data, len);
+		assert(_entry.header.compressionMethod == 8);
+		_zlibStream.next_out = (Bytef*)data;
+		_zlibStream.avail_out = (uInt)std::min((uint64_t)std::min(len, (long)BLOCKSIZE), _restUnCompressed);
+		long cbReaded = 0;
+		while (_zlibStream.avail_out > 0)
+		{
+			if (_zlibStream.avail_in == 0 && _restCompressed > 0)
+			{
+				const byte* mapped = _srcInput->data();
+				if (mapped)
+				{
+					//
+					// inflate straight from the mapping, no copy
+					//
+					uInt cb = (uInt)std::min((uint64_t)BLOCKSIZE, _restCompressed);
+					_zlibStream.next_in = (Bytef*)(mapped + _begin + _offset);
+					_zlibStream.avail_in = cb;
+					_offset += cb;
+					_restCompressed -= cb;
+				}
+				else if (_readAhead != NULL)
+				{
+					const byte* window = NULL;
+					long cbInput = _readAhead->next(window);
+					if (cbInput <= 0)
+						return cbReaded > 0 ? cbReaded : -1;
+					_offset += cbInput;
+					_restCompressed -= cbInput;
+					_zlibStream.next_in = (Bytef*)window;
+					_zlibStream.avail_in = cbInput;
+				}
+				else
+				{
+					long cb = (long)std::min((uint64_t)BUFSIZE, _restCompressed);
+					long cbInput = _srcInput->readAt(_begin + _offset, &_buffer[0], cb);
+					if (cbInput <= 0)
+						return cbReaded > 0 ? cbReaded : -1;
+					_offset += cbInput;
+					_restCompressed -= cbInput;
+					_zlibStream.next_in = &_buffer[0];
+					_zlibStream.avail_in = cbInput;
+				}
+			}
+			uLong outBefore = _zlibStream.total_out;
+			int err = ::inflate(&_zlibStream, _recording ? Z_BLOCK : Z_SYNC_FLUSH);
+			uLong outAfter = _zlibStream.total_out;
+			uint32_t currentSize = outAfter - outBefore;
+			_restUnCompressed -= currentSize;
+			_position += currentSize;
+			cbReaded += currentSize;
+			if (err == Z_STREAM_END)
+			{
+				if (_recording)
+					_points->finish();
+				_recording = false;
+				break;
+			}
+			if (err != Z_OK && (err != Z_BUF_ERROR || _restCompressed == 0))
+				return cbReaded > 0 ? cbReaded : -1;
+			if (_recording && _position >= _nextPoint &&
+				(_zlibStream.data_type & 128) && !(_zlibStream.data_type & 64))
+			{
+				_points->add(_position, _offset - _zlibStream.avail_in, _zlibStream.data_type & 7, &_zlibStream);
+				_nextPoint = _position + _points->span();
+			}
+		}
+		return cbReaded;
+	}
+
+	long _readDecoded(byte *data, long len)
+	{
+		long cb = _decoder->read(data, std::min((uint64_t)len, _restUnCompressed));
+		if (cb > 0)
+		{
+			_position += cb;
+			_restUnCompressed -= cb;
+		}
+		return cb;
+	}
+
+	long _readStored(byte *data, long len)
+	{
+		long cb = (long)std::min((uint64_t)len, _restUnCompressed);
+		if (cb == 0)
+			return 0;
+		cb = _srcInput->readAt(_begin + _position, data, cb);
+		if (cb <= 0)
+			return -1;
+		_position += cb;
+		_restUnCompressed -= cb;
+		return cb;
+	}
+
+	void _restart(const ZipAccessPoints::Point* point)
+	{
+		::inflateReset(&_zlibStream);
+		_zlibStream.avail_in = 0;
+		_offset = point ? point->in : 0;
+		_position = point ? point->out : 0;
+		if (point && point->bits)
+		{
+			byte last = 0;
+			_offset--;
+			if (_srcInput->readAt(_begin + _offset, &last, 1) == 1)
+				::inflatePrime(&_zlibStream, point->bits, last >> (8 - point->bits));
+			_offset++;
+		}
+		if (point && !point->window.empty())
+			::inflateSetDictionary(&_zlibStream, &point->window[0], point->window.size());
+		_restCompressed = _entry.compressedSize - _offset;
+		_restUnCompressed = _entry.uncompressedSize - _position;
+		_crc = 0;
+		_checking = _verify && _position == 0;
+		if (_readAhead != NULL)
+			_readAhead->start(_begin + _offset, _begin + _entry.compressedSize);
+		_recording = (_points != NULL && !_points->complete());
+		_nextPoint = _recording ? std::max(_points->next(), _position + 1) : 0;
+
+		//
+		// methods served by a codec start over from the front
+		//
+		Codec* codec = Codec::find(_entry.header.compressionMethod);
+		if (codec)
+			_decoder = codec->decoder(OpenRange(_srcInput.get(), _begin, _entry.compressedSize).get(), _entry.uncompressedSize);
+	}
+
+	z_stream _zlibStream;
+	StrongPtr<DataInput> _srcInput;
+	StrongPtr<ZipAccessPoints> _points;
+	StrongPtr<ZipReadAhead> _readAhead;
+	StrongPtr<DataInput> _decoder;
+	bool _verify;
+	bool _checking;
+	uint32_t _crc;
+	bool _recording;
+	uint64_t _nextPoint;
+	uint64_t _begin;
+	uint64_t _offset;
+	uint64_t _position;
+	uint64_t _restCompressed;
+	uint64_t _restUnCompressed;
+	ZipEntry _entry;
+	ByteArray _buffer;
+};
+
+//
+// inflated content of one entry, shared by the cache and every input
+// handed out over it
+//
+class ZipBlob
+	: public Refable
+{
+public:
+	ByteArray bytes;
+};
+
+class ZipCache
+{
+public:
+	ZipCache()
+	{
+		_budget = 0;
+		::memset(&_stats, 0, sizeof(_stats));
+	}
+
+public:
+	long budget() const
+	{
+		return _budget;
+	}
+
+	void setBudget(long budget)
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_budget = budget;
+		_evict();
+	}
+
+	StrongPtr<ZipBlob> find(uint64_t key)
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		Blobs::iterator it = _blobs.find(key);
+		if (it == _blobs.end())
+		{
+			_stats.misses++;
+			return NULL;
+		}
+		_stats.hits++;
+		_order.splice(_order.begin(), _order, it->second.second);
+		return it->second.first;
+	}
+
+	StrongPtr<ZipBlob> insert(uint64_t key, ZipBlob* blob)
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		Blobs::iterator it = _blobs.find(key);
+		if (it != _blobs.end())
+			return it->second.first;
+		_order.push_front(key);
+		_blobs.insert(std::make_pair(key, std::make_pair(StrongPtr<ZipBlob>(blob), _order.begin())));
+		_stats.entries++;
+		_stats.bytes += blob->bytes.size();
+		_evict();
+		return blob;
+	}
+
+	ZipCacheStats stats()
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		return _stats;
+	}
+
+private:
+	void _evict()
+	{
+		while (_stats.bytes > _budget && !_order.empty())
+		{
+			Blobs::iterator it = _blobs.find(_order.back());
+			_stats.bytes -= it->second.first->bytes.size();
+			_stats.entries--;
+			_stats.evictions++;
+			_blobs.erase(it);
+			_order.pop_back();
+		}
+	}
+
+	typedef std::list<uint64_t> Order;
+	typedef std::unordered_map<uint64_t, std::pair<StrongPtr<ZipBlob>, Order::iterator> > Blobs;
+	std::mutex _mutex;
+	volatile long _budget;
+	ZipCacheStats _stats;
+	Order _order;
+	Blobs _blobs;
+};
+
+class ZipReaderImpl
+	: public ZipReader
+{
+public:
+	ZipReaderImpl(const wstr& fname, bool mapped = false)
+	{
+		_fileName = fname;
+		_mapped = mapped;
+		_vaild = -1;
+		_loaded = 0;
+		_listed = 0;
+		_srcOffset = 0;
+		_accessPointSpan = 0;
+		_verify = true;
+		_readAhead = 0;
+	}
+
+	ZipReaderImpl(DataInput* input)
+	{
+		assert(input && input->seekable());
+		_srcInput = input;
+		_mapped = false;
+		_vaild = -1;
+		_loaded = 0;
+		_listed = 0;
+		_srcOffset = input->position();
+		_accessPointSpan = 0;
+		_verify = true;
+		_readAhead = 0;
+	}
+
+	~ZipReaderImpl()
+	{
+		_srcInput.clear();
+		_index.clear();
+	}
+
+	bool good()
+	{
+		return _ensureValid();
+	}
+
+	StrongPtr<DataInput> item(const wstr& name)
+	{
+		ZipEntry entry;
+		if (!_lookup(name, entry))
+			return NULL;
+		if (_cache.budget() > 0)
+			return _cachedItem(&entry);
+		return _item(&entry);
+	}
+
+	bool exist(const wstr& name)
+	{
+		ZipEntry entry;
+		return _lookup(name, entry);
+	}
+
+	StrongPtr<DataInput> rawItem(const wstr& name, ZipRawEntry& raw)
+	{
+		ZipEntry entry;
+		if (!_lookup(name, entry))
+			return NULL;
+		LocalFileHeader localFileHeader;
+		long pos = _srcOffset + entry.offset;
+		if (!ReadDataAt(_srcInput.get(), pos, localFileHeader) ||
+			localFileHeader.signature != 0x04034B50)
+			return NULL;
+		uint64_t dataOffset =
+				pos +
+				sizeof(LocalFileHeader) +
+				localFileHeader.fileNameLength +
+				localFileHeader.extraFieldLength;
+		if (dataOffset + entry.compressedSize > (uint64_t)_srcInput->size())
+			return NULL;
+
+		raw.method = entry.header.compressionMethod;
+		raw.flags = entry.header.generalPurposeBitFlag;
+		raw.versionNeeded = entry.header.versionNeededToExtract;
+		raw.modified = entry.header.lastModFileDateTime;
+		raw.crc32 = entry.header.crc32;
+		raw.attributes = entry.header.externalFileAttributes;
+		raw.compressedSize = entry.compressedSize;
+		raw.uncompressedSize = entry.uncompressedSize;
+		raw.offset = entry.offset;
+		return OpenRange(_srcInput.get(), dataOffset, entry.compressedSize);
+	}
+
+	long readAll(const wstr& name, byte* buffer, long size)
+	{
+		ZipEntry entry;
+		if (!_lookup(name, entry) || entry.uncompressedSize > (uint64_t)size)
+			return -1;
+		return _readAll(&entry, buffer) ? (long)entry.uncompressedSize : -1;
+	}
+
+	bool readAll(const wstr& name, std::vector<byte>& data)
+	{
+		ZipEntry entry;
+		if (!_lookup(name, entry))
+			return false;
+
+		//
+		// deflate expands by 1032:1 at most, anything above is a broken
+		// central directory and not worth allocating for
+		//
+		if (entry.header.compressionMethod == Z_DEFLATED &&
+			entry.uncompressedSize / 1032 > entry.compressedSize + 1)
+			return false;
+		data.resize(entry.uncompressedSize);
+		if (_readAll(&entry, data.data()))
+			return true;
+		data.clear();
+		return false;
+	}
+
+	long count()
+	{
+		if (!_ensureValid())
+			return -1;
+		if (!atomic_load(&_loaded))
+			return _totalEntries;
+		return _entries.size();
+	}
+
+	long footprint()
+	{
+		if (!_ensureValid())
+			return -1;
+		long bytes = sizeof(ZipEntry) * _entries.capacity() +
+			_names.capacity() +
+			sizeof(uint32_t) * _slots.capacity() +
+			sizeof(uint32_t) * _sorted.capacity();
+		if (_index != NULL)
+			bytes += _index->size();
+		return bytes;
+	}
+
+	long list(const wstr& prefix, const ListCallback& callback)
+	{
+		if (!_ensureSorted())
+			return -1;
+		str path = ws2s(prefix);
+		long count = 0;
+		for (size_t i = _lowerBound(path.data(), path.length()); i < _sorted.size(); i++)
+		{
+			const ZipEntry* entry = &_entries[_sorted[i]];
+			if (!_hasPrefix(entry, path))
+				break;
+			count++;
+			if (!callback(s2ws(_name(entry))))
+				break;
+		}
+		return count;
+	}
+
+	long children(const wstr& dir, const ChildCallback& callback)
+	{
+		if (!_ensureSorted())
+			return -1;
+		str path = ws2s(dir);
+		if (!path.empty() && path.at(path.length() - 1) != '/')
+			path += '/';
+		long count = 0;
+		size_t i = _lowerBound(path.data(), path.length());
+		while (i < _sorted.size())
+		{
+			const ZipEntry* entry = &_entries[_sorted[i]];
+			if (!_hasPrefix(entry, path))
+				break;
+			const char* name = &_names[entry->nameOffset];
+			uint32_t length = entry->header.fileNameLength;
+			if (length == path.length())
+			{
+				i++;
+				continue;
+			}
+			count++;
+			const char* slash = (const char*)::memchr(name + path.length(), '/', length - path.length());
+			if (!slash)
+			{
+				if (!callback(s2ws(str(name, length)), false))
+					break;
+				i++;
+				continue;
+			}
+
+			//
+			// a folder, whether it has an entry or not; everything below
+			// it sorts before its name with the slash bumped to '0'
+			//
+			str folder(name, slash + 1 - name);
+			if (!callback(s2ws(folder), true))
+				break;
+			folder.at(folder.length() - 1) = '/' + 1;
+			i = _lowerBound(folder.data(), folder.length());
+		}
+		return count;
+	}
+
+	long readMany(const std::vector<wstr>& names, const ItemCallback& callback)
+	{
+		if (!_ensureValid())
+			return -1;
+		std::vector<std::pair<ZipEntry, size_t> > found;
+		found.reserve(names.size());
+		for (size_t i = 0; i < names.size(); i++)
+		{
+			ZipEntry entry;
+			if (_lookup(names[i], entry))
+				found.push_back(std::make_pair(entry, i));
+			else
+				callback(names[i], NULL);
+		}
+		std::sort(found.begin(), found.end(), _byOffset);
+
+		//
+		// a run goes on while the next entry is close enough that reading
+		// over the gap beats seeking, up to RUNSIZE; a mapping is read by
+		// the pager anyway and only gets the order
+		//
+		bool mapped = (_srcInput->data() != NULL);
+		long delivered = 0;
+		for (size_t i = 0; i < found.size(); )
+		{
+			uint64_t begin = found[i].first.offset;
+			uint64_t end = _extent(found[i].first);
+			size_t last = i + 1;
+			while (!mapped && last < found.size() &&
+				found[last].first.offset <= end + RUNGAP &&
+				_extent(found[last].first) - begin <= RUNSIZE)
+				end = std::max(end, _extent(found[last++].first));
+			StrongPtr<DataInput> run;
+			if (!mapped && end - begin <= RUNSIZE)
+				run = _readRun(begin, end);
+			for (; i < last; i++)
+			{
+				const ZipEntry* entry = &found[i].first;
+				StrongPtr<DataInput> input;
+				if (run != NULL)
+					input = _item(entry, false, run.get(), begin);
+				if (input == NULL)
+					input = _item(entry);
+				if (input != NULL)
+					delivered++;
+				callback(names[found[i].second], input.get());
+			}
+		}
+		return delivered;
+	}
+
+	void setCacheBudget(long budget)
+	{
+		_cache.setBudget(budget);
+	}
+
+	ZipCacheStats cacheStats()
+	{
+		return _cache.stats();
+	}
+
+	void setVerify(bool verify)
+	{
+		_verify = verify;
+	}
+
+	void setReadAhead(long window)
+	{
+		_readAhead = std::max(window, 0L);
+		if (_readAhead > 0 && _readAheadPool == NULL)
+			_readAheadPool = ThreadPool::create(0);
+	}
+
+	void setAccessPointSpan(long span)
+	{
+		_accessPointSpan = span;
+	}
+
+	bool buildAccessPoints(const wstr& name)
+	{
+		ZipEntry entry;
+		if (!_lookup(name, entry) || entry.header.compressionMethod != Z_DEFLATED)
+			return false;
+		StrongPtr<DataInput> input = _item(&entry, true);
+		return (input != NULL && input->seek(0, SEEK_END) == input->size());
+	}
+
+	//
+	// copies of every entry with its name and extra field, in directory
+	// order, and the start of the central directory, for a writter
+	// appending to the archive; false unless each entry made it into the
+	// table and callback took it
+	//
+	typedef std::function<bool(const str& name, ZipEntry& entry, const byte* extra, uint16_t length)> HeaderCallback;
+
+	bool headers(const HeaderCallback& callback, uint64_t& start)
+	{
+		if (!_ensureEntries() || _entries.size() != _totalEntries)
+			return false;
+
+		//
+		// the entry table keeps no extra fields, they come from another
+		// walk of the central directory
+		//
+		ByteArray buffer;
+		const byte* p = _centralDirectory(buffer);
+		if (!p)
+			return false;
+		const byte* end = p + _sizeOfCentralDirectory;
+		ZipEntry entry;
+		for (uint64_t i = 0; i < _totalEntries; i++)
+		{
+			if (!_decodeRecord(p, end, entry.header))
+				return false;
+			const char* name = (const char*)p + sizeof(CentralDirectoryFileHeader);
+			const byte* extra = (const byte*)name + entry.header.fileNameLength;
+			uint16_t length = entry.header.extraFieldLength;
+			if (!entry.widen(extra, length) ||
+				!callback(str(name, entry.header.fileNameLength), entry, extra, length))
+				return false;
+			p += _recordSize(entry.header);
+		}
+		start = _startOfCentralDirectory;
+		return true;
+	}
+
+	bool writeIndex()
+	{
+		if (_fileName.empty() || !_ensureValid())
+			return false;
+
+		//
+		// walk the central directory once more, the entry table does not
+		// keep record offsets
+		//
+		ByteArray buffer;
+		const byte* begin = _centralDirectory(buffer);
+		if (!begin)
+			return false;
+		const byte* end = begin + _sizeOfCentralDirectory;
+		ZipIndex index(_totalEntries);
+		CentralDirectoryFileHeader record;
+		const byte* p = begin;
+		for (uint64_t i = 0; i < _totalEntries && _decodeRecord(p, end, record); i++)
+		{
+			index.add((const char*)p + sizeof(record), record.fileNameLength, p - begin);
+			p += _recordSize(record);
+		}
+		ZipIndexHeader header = _indexHeader();
+		return index.write(ZipIndex::path(_fileName), header);
+	}
+
+	long extractAll(const wstr& targetDir, int threads, std::vector<wstr>* failures)
+	{
+		if (!_ensureEntries())
+			return -1;
+		str root = ws2s(targetDir);
+		if (root.empty() || root.at(root.length() - 1) != '/')
+			root += '/';
+
+		//
+		// folders are made up front on the calling thread, both the marked
+		// ones and the implied parents of files, so workers only create files
+		//
+		std::vector<const ZipEntry*> files;
+		std::vector<str> folders;
+		ExtractJob job;
+		job.failures = failures;
+		job.extracted = 0;
+		job.next = 0;
+		for (size_t i = 0; i < _entries.size(); i++)
+		{
+			const ZipEntry* entry = &_entries[i];
+			str name = _name(entry);
+			if (!_isSafePath(name))
+				job.fail(name);
+			else if (entry->header.isFloder() || name.at(name.length() - 1) == '/')
+				folders.push_back(name);
+			else
+			{
+				str::size_type pos = name.rfind('/');
+				if (pos != str::npos)
+					folders.push_back(name.substr(0, pos + 1));
+				files.push_back(entry);
+			}
+		}
+		if (!CreateFolder(s2ws(root)))
+			return -1;
+		std::sort(folders.begin(), folders.end());
+		folders.erase(std::unique(folders.begin(), folders.end()), folders.end());
+		for (size_t i = 0; i < folders.size(); i++)
+		{
+			bool marked = (_find(folders[i].data(), folders[i].length()) != NULL);
+			if (!CreateFolder(s2ws(root + folders[i])))
+				job.fail(folders[i]);
+			else if (marked)
+				job.extracted++;
+		}
+
+		if (threads <= 0)
+			threads = std::max(1, (int)std::thread::hardware_concurrency());
+		threads = std::min(threads, std::max(1, (int)files.size()));
+		job.root = &root;
+		job.files = &files;
+		std::vector<std::thread> workers;
+		for (int i = 1; i < threads; i++)
+			workers.push_back(std::thread(&ZipReaderImpl::_extractWorker, this, &job));
+		_extractWorker(&job);
+		for (size_t i = 0; i < workers.size(); i++)
+			workers[i].join();
+		return job.extracted;
+	}
+
+private:
+	struct ExtractJob
+	{
+		const str* root;
+		const std::vector<const ZipEntry*>* files;
+		std::vector<wstr>* failures;
+		std::mutex mutex;
+		volatile int32_t extracted;
+		volatile int32_t next;
+
+		void fail(const str& name)
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if (failures)
+				failures->push_back(s2ws(name));
+		}
+	};
+
+	void _extractWorker(ExtractJob* job)
+	{
+		ByteArray buffer(BUFSIZE * 16);
+		for (;;)
+		{
+			int32_t i = atomic_inc(&job->next);
+			if (i >= (int32_t)job->files->size())
+				break;
+			const ZipEntry* entry = (*job->files)[i];
+			if (_extractFile(entry, *job->root + _name(entry), buffer))
+				atomic_inc(&job->extracted);
+			else
+				job->fail(_name(entry));
+		}
+	}
+
+	bool _extractFile(const ZipEntry* entry, const str& path, ByteArray& buffer)
+	{
+		StrongPtr<DataInput> input = _item(entry);
+		wstr wpath = s2ws(path);
+		if (!input || wpath.empty())
+			return false;
+		StrongPtr<DataOutput> output = CreateFile(wpath);
+		long total = 0;
+		long cb;
+		while ((cb = input->read(&buffer[0], buffer.size())) > 0)
+		{
+			if (output->write(&buffer[0], cb) != cb)
+				return false;
+			total += cb;
+		}
+		return (cb == 0 && total == (long)entry->uncompressedSize);
+	}
+
+	static bool _isSafePath(const str& name)
+	{
+		if (name.empty() || name.at(0) == '/')
+			return false;
+		str::size_type begin = 0;
+		while (begin <= name.length())
+		{
+			str::size_type end = name.find('/', begin);
+			if (end == str::npos)
+				end = name.length();
+			if (name.compare(begin, end - begin, "..") == 0)
+				return false;
+			begin = end + 1;
+		}
+		return true;
+	}
+
+	//
+	// the entry out of source, which holds the archive from entry offset
+	// base on; the archive input itself, behind its prefix, when NULL
+	//
+	StrongPtr<DataInput> _item(const ZipEntry* entry, bool force = false, DataInput* source = NULL, uint64_t base = 0)
+	{
+		//
+		// sizes come from the central directory, the local header is only
+		// read for the length of what precedes the data; positional reads
+		// only, so that any number of threads can open items of one reader
+		// at the same time
+		//
+		if (entry->header.compressionMethod != 0 &&
+			entry->header.compressionMethod != Z_DEFLATED &&
+			!Codec::find(entry->header.compressionMethod))
 			return NULL;
-		_currentItem = new ZipOutput(_dstOutput.get(), fileHeader, &_endOfCentralDirectory, _srcOffset);
-		return _currentItem.get();
+		long pos = entry->offset - base;
+		if (!source)
+		{
+			source = _srcInput.get();
+			pos += _srcOffset;
+		}
+		LocalFileHeader localFileHeader;
+		if (!ReadDataAt(source, pos, localFileHeader) ||
+			localFileHeader.signature != 0x04034B50)
+			return NULL;
+
+		uint64_t dataOffset =
+				pos +
+				sizeof(LocalFileHeader) +
+				localFileHeader.fileNameLength +
+				localFileHeader.extraFieldLength;
+		if (source->size() >= 0 && dataOffset + entry->compressedSize > (uint64_t)source->size())
+			return NULL;
+
+		//
+		// stored entry of a memory resident archive, hand out a view
+		// into the mapping instead of copying through ZipInput, checked
+		// up front since the view never sees a read, once per entry
+		//
+		const byte* mapped = source->data();
+		if (mapped && entry->header.compressionMethod == 0)
+		{
+			if (_verify && !_verifyStored(*entry, mapped + dataOffset))
+				return NULL;
+			return OpenMemory(mapped + dataOffset, entry->uncompressedSize, source);
+		}
+
+		StrongPtr<ZipAccessPoints> points;
+		StrongPtr<ZipReadAhead> readAhead;
+		if (entry->header.compressionMethod == Z_DEFLATED)
+		{
+			points = _accessPointsOf(*entry, force);
+
+			if (_readAhead > 0 && !mapped)
+				readAhead = new ZipReadAhead(source, _readAheadPool.get(), _readAhead, entry->compressedSize);
+		}
+		return new ZipInput(source, *entry, dataOffset, points.get(), _verify, readAhead.get());
+	}
+
+	//
+	// the entry into out, uncompressedSize bytes; local header and data
+	// come with one read and inflate runs once with Z_FINISH. Other
+	// codecs and entries too large to hold twice go through ZipInput
+	//
+	bool _readAll(const ZipEntry* entry, byte* out)
+	{
+		if (_cache.budget() > 0)
+		{
+			StrongPtr<ZipBlob> blob = _cache.find(entry->offset);
+			if (blob != NULL)
+			{
+				if (!blob->bytes.empty())
+					::memcpy(out, blob->bytes.data(), blob->bytes.size());
+				return true;
+			}
+		}
+
+		int method = entry->header.compressionMethod;
+		const byte* mapped = _srcInput->data();
+		if ((method != 0 && method != Z_DEFLATED) ||
+			(!mapped && entry->compressedSize > RUNSIZE) ||
+			entry->compressedSize > 0xFFFFFFFF || entry->uncompressedSize > 0xFFFFFFFF)
+			return _readAllFrom(_item(entry).get(), out, entry->uncompressedSize);
+
+		long pos = _srcOffset + entry->offset;
+		long available = _srcInput->size() - pos;
+		ByteArray bytes;
+		const byte* data = mapped + pos;
+		if (!mapped)
+		{
+			bytes.resize(_extent(*entry) - entry->offset);
+			available = _srcInput->readAt(pos, &bytes[0], bytes.size());
+			data = &bytes[0];
+		}
+		LocalFileHeader localFileHeader;
+		if (pos < 0 || available < (long)sizeof(LocalFileHeader))
+			return false;
+		::memcpy(&localFileHeader, data, sizeof(LocalFileHeader));
+		if (localFileHeader.signature != 0x04034B50)
+			return false;
+		uint64_t dataOffset =
+				sizeof(LocalFileHeader) +
+				localFileHeader.fileNameLength +
+				localFileHeader.extraFieldLength;
+		if (dataOffset + entry->compressedSize > (uint64_t)available)
+		{
+			//
+			// the local extra field is longer than the central one
+			//
+			if (mapped)
+				return false;
+			bytes.resize(dataOffset + entry->compressedSize);
+			if (_srcInput->readAt(pos, &bytes[0], bytes.size()) != (long)bytes.size())
+				return false;
+			data = &bytes[0];
+		}
+
+		if (method == 0)
+		{
+			//
+			// out is NULL for an empty entry read into an empty vector
+			//
+			if (entry->compressedSize != entry->uncompressedSize)
+				return false;
+			if (entry->uncompressedSize > 0)
+				::memcpy(out, data + dataOffset, entry->uncompressedSize);
+		}
+		else
+		{
+			//
+			// zlib turns down a NULL output even with no room asked for,
+			// which is what an empty vector hands over
+			//
+			byte none;
+			z_stream zlibStream;
+			::memset(&zlibStream, 0, sizeof(z_stream));
+			if (::inflateInit2(&zlibStream, -MAX_WBITS) != Z_OK)
+				return false;
+			zlibStream.next_in = (Bytef*)(data + dataOffset);
+			zlibStream.avail_in = (uInt)entry->compressedSize;
+			zlibStream.next_out = (Bytef*)(out ? out : &none);
+			zlibStream.avail_out = (uInt)entry->uncompressedSize;
+			int err = ::inflate(&zlibStream, Z_FINISH);
+			bool done = err == Z_STREAM_END && zlibStream.total_out == entry->uncompressedSize;
+			::inflateEnd(&zlibStream);
+			if (!done)
+				return false;
+		}
+		return !_verify || Crc32(0, out, entry->uncompressedSize) == entry->header.crc32;
+	}
+
+	static bool _readAllFrom(DataInput* input, byte* out, uint64_t size)
+	{
+		if (!input)
+			return false;
+		uint64_t total = 0;
+		long cb = 0;
+		while (total < size &&
+			(cb = input->read(out + total, (long)std::min(size - total, (uint64_t)BLOCKSIZE))) > 0)
+			total += cb;
+		return total == size;
+	}
+
+	static bool _byOffset(const std::pair<ZipEntry, size_t>& a, const std::pair<ZipEntry, size_t>& b)
+	{
+		return a.first.offset < b.first.offset;
+	}
+
+	//
+	// where the entry probably ends, taking the local extra field to be
+	// as long as the central one; _item() turns down a guess too short
+	//
+	static uint64_t _extent(const ZipEntry& entry)
+	{
+		return entry.offset + sizeof(LocalFileHeader) +
+			entry.header.fileNameLength + entry.header.extraFieldLength +
+			entry.compressedSize + 256;
+	}
+
+	//
+	// archive bytes from begin to end in one read, as an input of its own
+	//
+	StrongPtr<DataInput> _readRun(uint64_t begin, uint64_t end)
+	{
+		StrongPtr<ZipBlob> blob = new ZipBlob();
+		blob->bytes.resize(end - begin);
+		long cb = _srcInput->readAt(_srcOffset + begin, &blob->bytes[0], blob->bytes.size());
+		if (cb <= 0)
+			return NULL;
+		return OpenMemory(&blob->bytes[0], cb, blob.get());
+	}
+
+	StrongPtr<DataInput> _cachedItem(const ZipEntry* entry)
+	{
+		//
+		// entries above a quarter of the budget would push out most of
+		// the cache, and stored entries of a mapping are already free
+		//
+		if (entry->uncompressedSize > (uint64_t)_cache.budget() / 4 ||
+			(entry->header.compressionMethod == 0 && _srcInput->data()))
+			return _item(entry);
+
+		StrongPtr<ZipBlob> blob = _cache.find(entry->offset);
+		if (!blob)
+		{
+			StrongPtr<DataInput> input = _item(entry);
+			if (!input)
+				return NULL;
+			blob = new ZipBlob();
+			blob->bytes.resize(entry->uncompressedSize);
+			long total = 0;
+			long cb = 0;
+			while (total < (long)blob->bytes.size() &&
+				(cb = input->read(&blob->bytes[total], blob->bytes.size() - total)) > 0)
+				total += cb;
+			if (total != (long)blob->bytes.size())
+				return _item(entry);
+			blob = _cache.insert(entry->offset, blob.get());
+		}
+		return OpenMemory(blob->bytes.data(), blob->bytes.size(), blob.get());
+	}
+
+	StrongPtr<ZipAccessPoints> _accessPointsOf(const ZipEntry& entry, bool force)
+	{
+		std::lock_guard<std::mutex> lock(_accessPointsMutex);
+		AccessPoints::iterator it = _accessPoints.find(entry.offset);
+		if (it != _accessPoints.end())
+			return it->second;
+		long span = _accessPointSpan > 0 ? _accessPointSpan : (force ? SPANSIZE : 0);
+		if (span == 0 || entry.uncompressedSize <= (uint64_t)span)
+			return NULL;
+		StrongPtr<ZipAccessPoints> points = new ZipAccessPoints(span);
+		_accessPoints.insert(std::make_pair(entry.offset, points));
+		return points;
+	}
+
+	bool _verifyStored(const ZipEntry& entry, const byte* data)
+	{
+		{
+			std::lock_guard<std::mutex> lock(_accessPointsMutex);
+			if (_verified.count(entry.offset))
+				return true;
+		}
+		if (Crc32(0, data, entry.uncompressedSize) != entry.header.crc32)
+			return false;
+		std::lock_guard<std::mutex> lock(_accessPointsMutex);
+		_verified.insert(entry.offset);
+		return true;
+	}
+
+	bool _lookup(const wstr& name, ZipEntry& entry)
+	{
+		if (!_ensureValid())
+			return false;
+		str path = ws2s(name);
+		if (!atomic_load(&_loaded))
+			return _findIndexed(path.data(), path.length(), entry);
+		const ZipEntry* found = _find(path.data(), path.length());
+		if (!found)
+			return false;
+		entry = *found;
+		return true;
+	}
+
+	bool _findIndexed(const char* name, uint32_t length, ZipEntry& entry)
+	{
+		const ZipIndexHeader* header = (const ZipIndexHeader*)_index->data();
+		const ZipIndexSlot* slots = (const ZipIndexSlot*)(header + 1);
+		uint32_t h = hash(name, length);
+		uint64_t mask = header->slotCount - 1;
+		ByteArray candidate;
+
+		//
+		// a table has empty slots to stop at, a damaged one may not
+		//
+		uint64_t probes = header->slotCount;
+		for (uint64_t i = h & mask; slots[i].offset != 0 && probes > 0; i = (i + 1) & mask, probes--)
+		{
+			if (slots[i].hash != h || slots[i].nameLength != length)
+				continue;
+			if (slots[i].offset - 1 + sizeof(CentralDirectoryFileHeader) + length > _sizeOfCentralDirectory)
+				return false;
+			long pos = _srcOffset + _startOfCentralDirectory + slots[i].offset - 1;
+			if (!ReadDataAt(_srcInput.get(), pos, entry.header) ||
+				entry.header.fileNameLength != length)
+				return false;
+
+			//
+			// name and extra field in one read, the latter may carry the
+			// Zip64 sizes
+			//
+			candidate.resize(length + entry.header.extraFieldLength);
+			if (_srcInput->readAt(pos + sizeof(entry.header), candidate.data(), candidate.size()) != (long)candidate.size())
+				return false;
+			if (compare((const char*)candidate.data(), length, name, length))
+			{
+				entry.hash = h;
+				entry.nameOffset = 0;
+				return entry.widen(candidate.data() + length, entry.header.extraFieldLength);
+			}
+		}
+		return false;
+	}
+
+	ZipIndexHeader _indexHeader()
+	{
+		ZipIndexHeader header;
+		header.archiveSize = _srcInput->size();
+		header.startOfCentralDirectory = _startOfCentralDirectory;
+		header.sizeOfCentralDirectory = _sizeOfCentralDirectory;
+		header.totalEntries = _totalEntries;
+		return header;
+	}
+
+	bool _openIndex()
+	{
+		if (_fileName.empty())
+			return false;
+		StrongPtr<DataInput> index = OpenMappedFile(ZipIndex::path(_fileName));
+		const ZipIndexHeader* header = (const ZipIndexHeader*)index->data();
+		if (!header || index->size() < (long)sizeof(ZipIndexHeader))
+			return false;
+		if (!header->matches(_indexHeader()) ||
+			header->slotCount == 0 ||
+			(header->slotCount & (header->slotCount - 1)) != 0 ||
+			header->slotCount <= header->totalEntries ||
+			(uint64_t)index->size() != sizeof(ZipIndexHeader) + header->slotCount * sizeof(ZipIndexSlot))
+			return false;
+		_index = index;
+		return true;
+	}
+
+	str _name(const ZipEntry* entry) const
+	{
+		return str(&_names[entry->nameOffset], entry->header.fileNameLength);
+	}
+
+	const ZipEntry* _find(const char* name, uint32_t length) const
+	{
+		if (_slots.empty())
+			return NULL;
+		uint32_t h = hash(name, length);
+		uint32_t mask = _slots.size() - 1;
+		for (uint32_t i = h & mask; _slots[i] != 0; i = (i + 1) & mask)
+		{
+			const ZipEntry* entry = &_entries[_slots[i] - 1];
+			if (entry->hash == h &&
+				compare(&_names[entry->nameOffset], entry->header.fileNameLength, name, length))
+				return entry;
+		}
+		return NULL;
+	}
+
+	void _buildIndex()
+	{
+		//
+		// open addressing with linear probing, kept at most half full;
+		// a slot holds the entry index plus one so that zero means empty
+		//
+		uint32_t size = 16;
+		while (size < _entries.size() * 2)
+			size <<= 1;
+		_slots.assign(size, 0);
+		uint32_t mask = size - 1;
+		size_t kept = 0;
+		for (size_t n = 0; n < _entries.size(); n++)
+		{
+			ZipEntry& entry = _entries[n];
+			const char* name = &_names[entry.nameOffset];
+			entry.hash = hash(name, entry.header.fileNameLength);
+			if (_find(name, entry.header.fileNameLength))
+				continue;
+			uint32_t i = entry.hash & mask;
+			while (_slots[i] != 0)
+				i = (i + 1) & mask;
+			if (kept != n)
+				_entries[kept] = entry;
+			_slots[i] = ++kept;
+		}
+		_entries.resize(kept);
+	}
+
+	//
+	// decodes the central directory record at p, false once it runs past
+	// end or does not carry the record signature
+	//
+	static bool _decodeRecord(const byte* p, const byte* end, CentralDirectoryFileHeader& header)
+	{
+		if (end - p < (long)sizeof(CentralDirectoryFileHeader))
+			return false;
+		::memcpy(&header, p, sizeof(CentralDirectoryFileHeader));
+		return header.signature == 0x02014B50 &&
+			end - p >= _recordSize(header);
+	}
+
+	static long _recordSize(const CentralDirectoryFileHeader& header)
+	{
+		return sizeof(CentralDirectoryFileHeader) +
+			header.fileNameLength +
+			header.extraFieldLength +
+			header.fileCommentLength;
+	}
+
+	//
+	// the whole central directory in memory, straight from the mapping
+	// when there is one, otherwise fetched into buffer with a single read
+	//
+	const byte* _centralDirectory(ByteArray& buffer)
+	{
+		long pos = _srcOffset + _startOfCentralDirectory;
+		long size = _srcInput->size();
+		if (size >= 0 && pos + (long)_sizeOfCentralDirectory > size)
+			return NULL;
+		const byte* mapped = _srcInput->data();
+		if (mapped)
+			return mapped + pos;
+		buffer.resize(_sizeOfCentralDirectory);
+		if (_srcInput->readAt(pos, buffer.data(), buffer.size()) != (long)buffer.size())
+			return NULL;
+		return buffer.data();
+	}
+
+	//
+	// the record is 22 bytes followed by a comment of at most 64K at the
+	// very end, so fetch that tail at once and scan it backwards with
+	// memrchr for the signature
+	//
+	bool _findEndOfCentralDirectory(long& found)
+	{
+		long end = _srcInput->size();
+		long begin = std::max((long)_srcOffset, end - (long)(0xFFFF + sizeof(EndOfCentralDirectory)));
+		long length = end - begin;
+		if (length < (long)sizeof(EndOfCentralDirectory))
+			return false;
+		ByteArray buffer;
+		const byte* tail = _srcInput->data();
+		if (tail)
+			tail += begin;
+		else
+		{
+			buffer.resize(length);
+			if (_srcInput->readAt(begin, &buffer[0], length) != length)
+				return false;
+			tail = &buffer[0];
+		}
+		const byte* p = tail + length - sizeof(EndOfCentralDirectory) + 1;
+		while ((p = (const byte*)::memrchr(tail, 0x50, p - tail)) != NULL)
+		{
+			if (p[1] == 0x4b && p[2] == 0x05 && p[3] == 0x06)
+			{
+				long commentLength = p[0x16 - 2] + (p[0x16 - 1] << 8);
+				if (p + sizeof(EndOfCentralDirectory) + commentLength == tail + length)
+				{
+					found = begin + (p - tail);
+					return true;
+				}
+			}
+		}
+		return false;
+	}
+
+	bool _ensureValid()
+	{
+		int32_t vaild = atomic_load(&_vaild);
+		if (vaild != -1)
+			return (vaild == 1);
+		std::lock_guard<std::mutex> lock(_mutex);
+		if (_vaild != -1)
+			return (_vaild == 1);
+		bool loaded = _loadEndOfCentralDirectory();
+		if (loaded && !_openIndex())
+		{
+			loaded = _loadEntries();
+			atomic_store(1, &_loaded);
+		}
+		atomic_store(loaded ? 1 : 0, &_vaild);
+		return loaded;
+	}
+
+	//
+	// the entry table is skipped when a lookup index is present, and only
+	// built for the calls that walk every entry
+	//
+	bool _ensureEntries()
+	{
+		if (!_ensureValid())
+			return false;
+		if (atomic_load(&_loaded))
+			return true;
+		std::lock_guard<std::mutex> lock(_mutex);
+		if (!_loaded)
+		{
+			if (!_loadEntries())
+				return false;
+			atomic_store(1, &_loaded);
+		}
+		return true;
+	}
+
+	//
+	// entry numbers in byte order of their names, built on the first
+	// listing
+	//
+	bool _ensureSorted()
+	{
+		if (!_ensureEntries())
+			return false;
+		if (atomic_load(&_listed))
+			return true;
+		std::lock_guard<std::mutex> lock(_mutex);
+		if (!_listed)
+		{
+			_sorted.resize(_entries.size());
+			for (size_t i = 0; i < _sorted.size(); i++)
+				_sorted[i] = i;
+			std::sort(_sorted.begin(), _sorted.end(), NameOrder(this));
+			atomic_store(1, &_listed);
+		}
+		return true;
+	}
+
+	struct NameOrder
+	{
+		const ZipReaderImpl* reader;
+
+		NameOrder(const ZipReaderImpl* owner)
+		{
+			reader = owner;
+		}
+
+		bool operator()(uint32_t a, uint32_t b) const
+		{
+			const ZipEntry& x = reader->_entries[a];
+			const ZipEntry& y = reader->_entries[b];
+			return less(&reader->_names[x.nameOffset], x.header.fileNameLength,
+				&reader->_names[y.nameOffset], y.header.fileNameLength);
+		}
+
+		bool operator()(uint32_t a, const str& key) const
+		{
+			const ZipEntry& x = reader->_entries[a];
+			return less(&reader->_names[x.nameOffset], x.header.fileNameLength, key.data(), key.length());
+		}
+
+		static bool less(const char* a, uint32_t lengthA, const char* b, uint32_t lengthB)
+		{
+			int order = ::memcmp(a, b, std::min(lengthA, lengthB));
+			return order < 0 || (order == 0 && lengthA < lengthB);
+		}
+	};
+
+	size_t _lowerBound(const char* name, uint32_t length) const
+	{
+		return std::lower_bound(_sorted.begin(), _sorted.end(), str(name, length), NameOrder(this)) - _sorted.begin();
+	}
+
+	bool _hasPrefix(const ZipEntry* entry, const str& prefix) const
+	{
+		return entry->header.fileNameLength >= prefix.length() &&
+			::memcmp(&_names[entry->nameOffset], prefix.data(), prefix.length()) == 0;
+	}
+
+	bool _loadEndOfCentralDirectory()
+	{
+		if (_srcInput == NULL && _mapped)
+		{
+			_srcInput = OpenMappedFile(_fileName);
+			if (!_srcInput->data())
+				_srcInput.clear();
+		}
+		if (_srcInput == NULL)
+			_srcInput = OpenFile(_fileName);
+		long pos = 0;
+		if (!_findEndOfCentralDirectory(pos) ||
+			!ReadDataAt(_srcInput.get(), pos, _endOfCentralDirectory))
+			return false;
+
+		if (_endOfCentralDirectory.totalEntries == 0xFFFF ||
+			_endOfCentralDirectory.startOfCentralDirectory == 0xFFFFFFFF ||
+			_endOfCentralDirectory.sizeOfCentralDirectory == 0xFFFFFFFF)
+		{
+			Zip64EndOfCentralDirectoryLocator zip64Locator;
+			Zip64EndOfCentralDirectory zip64EndOfCentralDirectory;
+
+			if (pos - (long)sizeof(zip64Locator) < _srcOffset ||
+				!ReadDataAt(_srcInput.get(), pos - sizeof(zip64Locator), zip64Locator) ||
+				zip64Locator.signature != 0x07064B50 ||
+				!ReadDataAt(_srcInput.get(), _srcOffset + zip64Locator.relativeOffsetOfCentralDirectory, zip64EndOfCentralDirectory) ||
+				zip64EndOfCentralDirectory.signature != 0x06064B50)
+				return false;
+
+			_totalEntries = zip64EndOfCentralDirectory.totalEntries;
+			_startOfCentralDirectory = zip64EndOfCentralDirectory.startOfCentralDirectory;
+			_sizeOfCentralDirectory = zip64EndOfCentralDirectory.sizeOfCentralDirectory;
+		}
+		else
+		{
+			_totalEntries = _endOfCentralDirectory.totalEntries;
+			_startOfCentralDirectory = _endOfCentralDirectory.startOfCentralDirectory;
+			_sizeOfCentralDirectory = _endOfCentralDirectory.sizeOfCentralDirectory;
+		}
+		return true;
+	}
+
+	bool _loadEntries()
+	{
+		ByteArray buffer;
+		const byte* p = _centralDirectory(buffer);
+		if (!p)
+			return false;
+		const byte* end = p + _sizeOfCentralDirectory;
+		_entries.reserve(_totalEntries);
+		if (_sizeOfCentralDirectory > _totalEntries * sizeof(CentralDirectoryFileHeader))
+			_names.reserve(_sizeOfCentralDirectory - _totalEntries * sizeof(CentralDirectoryFileHeader));
+		ZipEntry entry;
+		for (uint64_t i = 0; i < _totalEntries && _decodeRecord(p, end, entry.header); i++)
+		{
+			const byte* name = p + sizeof(CentralDirectoryFileHeader);
+			if (entry.widen(name + entry.header.fileNameLength, entry.header.extraFieldLength))
+			{
+				entry.nameOffset = _names.size();
+				_names.insert(_names.end(), name, name + entry.header.fileNameLength);
+				_entries.push_back(entry);
+			}
+			p += _recordSize(entry.header);
+		}
+		_buildIndex();
+		return true;
 	}
 
 private:
-	bool _alreadyFlush;
+	volatile int32_t _vaild;
+	volatile int32_t _loaded;
+	volatile int32_t _listed;
+	std::mutex _mutex;
 	long _srcOffset;
+	bool _mapped;
 	EndOfCentralDirectory _endOfCentralDirectory;
-	FileHeaders _fileHeaders;
-	StrongPtr<ZipOutput> _currentItem;
-	StrongPtr<DataOutput> _dstOutput;
+	uint64_t _totalEntries;
+	uint64_t _startOfCentralDirectory;
+	uint64_t _sizeOfCentralDirectory;
+	StrongPtr<DataInput> _index;
+	ZipCache _cache;
+	typedef std::map<uint64_t, StrongPtr<ZipAccessPoints> > AccessPoints;
+	AccessPoints _accessPoints;
+	std::set<uint64_t> _verified;
+	std::mutex _accessPointsMutex;
+	long _accessPointSpan;
+	bool _verify;
+	long _readAhead;
+	StrongPtr<ThreadPool> _readAheadPool;
+	std::vector<ZipEntry> _entries;
+	std::vector<char> _names;
+	std::vector<uint32_t> _slots;
+	std::vector<uint32_t> _sorted;
+	StrongPtr<DataInput> _srcInput;
 	wstr _fileName;
 };
 
-class ZipInput
-	: public DataInput
+//
+// input of a ZipStreamReader with room to look ahead, local headers
+// and data descriptors are parsed straight from the buffer
+//
+class ZipStreamSource
+	: public Refable
 {
 public:
-	ZipInput(DataInput* input, CentralDirectoryFileHeader* header, uint32_t begin)
+	ZipStreamSource(DataInput* input)
 	{
 		_srcInput = input;
-		_begin = begin;
-		_header = header;
-		_offset = 0;
-		_restCompressed = _header->compressedSize;
-		_restUnCompressed = _header->uncompressedSize;
-		_buffer.resize(BUFSIZE);
-		::memset(&_zlibStream, 0, sizeof(z_stream));
-		::inflateInit2(&_zlibStream, -MAX_WBITS);
+		_buffer.resize(BUFSIZE * 16);
+		_pos = 0;
+		_end = 0;
+		_eof = false;
 	}
 
-	~ZipInput()
+	~ZipStreamSource()
 	{
-		::inflateEnd(&_zlibStream);
+		_srcInput.clear();
 	}
 
 public:
-	long read(byte *data, long len)
+	//
+	// buffers at least need bytes, fewer only at the end of the input,
+	// and returns what is buffered
+	//
+	long fill(long need)
 	{
-		assert(_header->compressionMethod == 8);
-		_zlibStream.next_out = (Bytef*)data;
-		_zlibStream.avail_out = std::min((uint32_t)len, _restUnCompressed);
-		uint32_t cbReaded = 0;
-		while (_zlibStream.avail_out > 0)
+		if (_end - _pos >= need || _eof)
+			return _end - _pos;
+		if (_pos > 0)
 		{
-			if (_zlibStream.avail_in == 0 && _restCompressed > 0)
+			::memmove(&_buffer[0], &_buffer[_pos], _end - _pos);
+			_end -= _pos;
+			_pos = 0;
+		}
+		if ((long)_buffer.size() < need)
+			_buffer.resize(need);
+		while (_end < need)
+		{
+			long cb = _srcInput->read(&_buffer[_end], _buffer.size() - _end);
+			if (cb <= 0)
 			{
-				uint32_t cb = std::min((uint32_t)BUFSIZE, _restCompressed);
-				_srcInput->seek(_begin + _offset);
-				long cbInput = _srcInput->read(&_buffer[0], cb);
-				_offset += cbInput;
-				_restCompressed -= cbInput;
-				_zlibStream.next_in = &_buffer[0];
-				_zlibStream.avail_in = cbInput;
-			}
-			uint32_t outBefore = _zlibStream.total_out;
-			int err = ::inflate(&_zlibStream, Z_SYNC_FLUSH);
-			uint32_t outAfter = _zlibStream.total_out;
-			uint32_t currentSize = outAfter - outBefore;
-			_restUnCompressed -= currentSize;
-			cbReaded += currentSize;
-			if (err == Z_STREAM_END)
+				_eof = true;
 				break;
+			}
+			_end += cb;
 		}
-		return cbReaded;
+		return _end - _pos;
 	}
 
-	long size() const
+	const byte* data() const
+	{
+		return &_buffer[_pos];
+	}
+
+	void consume(long n)
+	{
+		_pos += n;
+	}
+
+	long read(byte *data, long len)
+	{
+		long cb = std::min(len, fill(1));
+		::memcpy(data, &_buffer[_pos], cb);
+		_pos += cb;
+		return cb;
+	}
+
+	bool skip(uint64_t n)
 	{
-		return _header->uncompressedSize;
+		while (n > 0)
+		{
+			long cb = (long)std::min((uint64_t)fill(1), n);
+			if (cb == 0)
+				return false;
+			_pos += cb;
+			n -= cb;
+		}
+		return true;
 	}
 
 private:
-	z_stream _zlibStream;
-	DataInput* _srcInput;
-	uint32_t _begin;
-	uint32_t _offset;
-	uint32_t _restCompressed;
-	uint32_t _restUnCompressed;
-	CentralDirectoryFileHeader* _header;
+	StrongPtr<DataInput> _srcInput;
 	ByteArray _buffer;
+	long _pos;
+	long _end;
+	bool _eof;
 };
 
-class ZipReaderImpl
-	: public ZipReader
+//
+// compressed bytes of one entry for a codec decoder, which reads them
+// front to back, so positions only ever move forward
+//
+class ZipStreamRange
+	: public DataInput
 {
 public:
-	ZipReaderImpl(const wstr& fname)
+	ZipStreamRange(ZipStreamSource* source)
 	{
-		_fileName = fname;
-		_vaild = -1;
-		_srcOffset = 0;
+		_source = source;
+		_position = 0;
 	}
 
-	ZipReaderImpl(DataInput* input)
+public:
+	long read(byte *data, long len)
 	{
-		assert(input && input->seekable());
-		_srcInput = input;
-		_vaild = -1;
-		_srcOffset = input->position();
+		long total = 0;
+		while (total < len)
+		{
+			long cb = _source->read(data + total, len - total);
+			if (cb <= 0)
+				break;
+			total += cb;
+		}
+		_position += total;
+		return total;
 	}
 
-	~ZipReaderImpl()
+	long readAt(long pos, byte *data, long len)
 	{
-		FileHeaders::iterator it = _fileHeaders.begin();
-		for (; it != _fileHeaders.end(); it++)
-			delete it->second;
-		_srcInput.clear();
+		if (pos < _position || !_source->skip(pos - _position))
+			return -1;
+		_position = pos;
+		return read(data, len);
 	}
 
-	bool good()
+	long position() const
 	{
-		return _ensureValid();
+		return _position;
 	}
 
-	StrongPtr<DataInput> item(const wstr& name)
+private:
+	StrongPtr<ZipStreamSource> _source;
+	long _position;
+};
+
+static inline uint32_t _load32(const byte* p)
+{
+	uint32_t value;
+	::memcpy(&value, p, sizeof(value));
+	return value;
+}
+
+static inline uint64_t _load64(const byte* p)
+{
+	uint64_t value;
+	::memcpy(&value, p, sizeof(value));
+	return value;
+}
+
+class ZipStreamItem
+	: public DataInput
+{
+public:
+	ZipStreamItem(ZipStreamSource* source, const LocalFileHeader& header, uint64_t compressedSize, uint64_t uncompressedSize, bool zip64)
 	{
-		CentralDirectoryFileHeader* header = _fileHeader(name);
-		if (!header)
-			return NULL;
-		_srcInput->seek(_srcOffset + header->relativeOffsetOfLocalHeader);
-		LocalFileHeader localFileHeader;
-		if (!localFileHeader.parse(_srcInput.get()))
-			return NULL;
+		_source = source;
+		_header = header;
+		_compressedSize = compressedSize;
+		_uncompressedSize = uncompressedSize;
+		_zip64 = zip64;
+		_trailing = (header.generalPurposeBitFlag & 0x08) != 0;
+		_position = 0;
+		_consumed = 0;
+		_crc = 0;
+		_ended = false;
+		_finished = false;
+		_failed = false;
+		::memset(&_zlibStream, 0, sizeof(z_stream));
+		::inflateInit2(&_zlibStream, -MAX_WBITS);
+		Codec* codec = Codec::find(header.compressionMethod);
+		if (codec)
+		{
+			_range = new ZipStreamRange(source);
+			_decoder = codec->decoder(_range.get(), _trailing ? -1 : (long)uncompressedSize);
+		}
+	}
 
-		uint32_t offsetOfExtra =
-				_srcOffset +
-				header->relativeOffsetOfLocalHeader +
-				sizeof(LocalFileHeader) +
-				localFileHeader.fileNameLength;
+	~ZipStreamItem()
+	{
+		::inflateEnd(&_zlibStream);
+		_decoder.clear();
+		_range.clear();
+		_source.clear();
+	}
+
+public:
+	bool supported() const
+	{
+		return !(_header.generalPurposeBitFlag & 0x01) &&
+			(_header.compressionMethod == 0 ||
+				_header.compressionMethod == Z_DEFLATED ||
+				_decoder != NULL);
+	}
 
-		if (localFileHeader.versionNeededToExtract == 45)
+	long read(byte *data, long len)
+	{
+		if (_failed || !supported())
+			return -1;
+		if (_finished || len <= 0)
+			return 0;
+		long cb = _ended ? 0 : _read(data, len);
+		if (cb < 0)
+		{
+			_failed = true;
+			return -1;
+		}
+		_crc = Crc32(_crc, data, cb);
+		_position += cb;
+		if (_ended && !_finish())
 		{
-			_srcInput->seek(offsetOfExtra);
-			Zip64ExtraField extraField;
-			extraField.parse(_srcInput.get());
-			header->compressedSize = extraField.compressedSize;
-			header->uncompressedSize = extraField.uncompressedSize;
+			_failed = true;
+			return -1;
 		}
+		return cb;
+	}
 
-		uint32_t dataOffset = offsetOfExtra + localFileHeader.extraFieldLength;
-		_srcInput->seek(dataOffset);
-		return new ZipInput(_srcInput.get(), header, dataOffset);
+	long position() const
+	{
+		return _position;
 	}
 
-	bool exist(const wstr& name)
+	long size() const
+	{
+		return _trailing ? -1 : (long)_uncompressedSize;
+	}
+
+	//
+	// moves the source past this entry, its data and descriptor
+	//
+	bool drain()
 	{
-		return (_fileHeader(name) != NULL);
+		if (!supported())
+		{
+			_failed = true;
+			return !_trailing && _source->skip(_compressedSize);
+		}
+		ByteArray scratch(BUFSIZE * 16);
+		long cb;
+		while ((cb = read(&scratch[0], scratch.size())) > 0)
+			;
+		return cb == 0;
 	}
 
 private:
-	CentralDirectoryFileHeader* _fileHeader(const wstr& name)
+	long _read(byte *data, long len)
 	{
-		if (!_ensureValid())
-			return NULL;
-		FileHeaders::iterator it = _fileHeaders.find(ws2s(name));
-		if (it == _fileHeaders.end())
-			return NULL;
-		return it->second;
+		if (_header.compressionMethod == 0)
+			return _trailing ? _readScanning(data, len) : _readStored(data, len);
+		if (_decoder != NULL)
+		{
+			long cb = _decoder->read(data, len);
+			_ended = (cb == 0);
+			return cb;
+		}
+		return _inflate(data, len);
+	}
+
+	long _readStored(byte *data, long len)
+	{
+		uint64_t rest = _uncompressedSize - _position;
+		_ended = (rest == 0);
+		if (_ended)
+			return 0;
+		long cb = _source->read(data, (long)std::min((uint64_t)len, rest));
+		if (cb <= 0)
+			return -1;
+		_consumed += cb;
+		_ended = ((uint64_t)cb == rest);
+		return cb;
 	}
 
-	bool _seekEndOfCentralDirectory(DataInput* input)
+	//
+	// stored entry of unknown length: the data ends where a descriptor
+	// signature is followed by the CRC and sizes of what came before it;
+	// the last bytes are held back until it is clear that no descriptor
+	// starts among them
+	//
+	long _readScanning(byte *data, long len)
 	{
-		byte buffer[BUFSIZE + 16];
-		long length = input->size();
-		for (long i = length; i > 0; i -= BUFSIZE)
+		long want = std::min(len, (long)BUFSIZE * 16);
+		long avail = _source->fill(want + sizeof(Zip64DataDescriptor));
+		const byte* p = _source->data();
+		long scan = std::min(want, avail - (long)sizeof(DataDescriptor) + 1);
+		for (long i = 0; i < scan; i++)
 		{
-			long offset = _srcOffset + std::max((long)0, (i - BUFSIZE));
-			input->seek(offset);
-			input->read(buffer, BUFSIZE + 0x16);
-			long bufferOffsetFromEndOfStream = length - offset;
-			for (int j = BUFSIZE - 0x16; j >= 0; j--)
+			const byte* found = (const byte*)::memchr(p + i, 0x50, scan - i);
+			if (!found)
+				break;
+			i = found - p;
+			if (_load32(found) == 0x08074B50 &&
+				_isDescriptor(found, avail - i, Crc32(_crc, p, i), _position + i))
 			{
-				if (buffer[j + 0] ==  0x50 && buffer[j + 1] ==  0x4b &&
-					buffer[j + 2] ==  0x05 && buffer[j + 3] ==  0x06)
-				{
-					long n1 = buffer[j + 0x16 - 2] + (buffer[j + 0x16 - 1] << 8);
-					long n2 = bufferOffsetFromEndOfStream - j - 0x16;
-					if (n1 == n2)
-					{
-						input->seek(offset + j);
-						return true;
-					}
-				}
+				::memcpy(data, p, i);
+				_source->consume(i);
+				_consumed += i;
+				_ended = true;
+				return i;
 			}
 		}
-		return false;
-	};
+		long cb = std::min(want, avail - (long)sizeof(Zip64DataDescriptor));
+		if (cb <= 0)
+			return -1;
+		::memcpy(data, p, cb);
+		_source->consume(cb);
+		_consumed += cb;
+		return cb;
+	}
 
-	bool _ensureValid()
+	static bool _isDescriptor(const byte* p, long avail, uint32_t crc, uint64_t size)
 	{
-		if (_vaild != -1)
-			return (_vaild == 1);
-		_vaild = 0;
-		if (_srcInput == NULL)
-			_srcInput = OpenFile(_fileName);
-		if (!_seekEndOfCentralDirectory(_srcInput.get()))
-			return false;
-		long pos = _srcInput->position();
-		if (!_endOfCentralDirectory.parse(_srcInput.get()))
+		if (avail < (long)sizeof(DataDescriptor) || _load32(p + 4) != crc)
 			return false;
+		if (size < 0xFFFFFFFF && _load32(p + 8) == size && _load32(p + 12) == size)
+			return true;
+		return (avail >= (long)sizeof(Zip64DataDescriptor) &&
+			_load64(p + 8) == size && _load64(p + 16) == size);
+	}
 
-		uint16_t totalEntries = 0;
-		uint32_t startOfCentralDirectory = 0;
-		if (_endOfCentralDirectory.totalEntries == 0xffff)
+	long _inflate(byte *data, long len)
+	{
+		_zlibStream.next_out = (Bytef*)data;
+		_zlibStream.avail_out = (uInt)std::min(len, (long)BLOCKSIZE);
+		long cbReaded = 0;
+		while (_zlibStream.avail_out > 0)
 		{
-			Zip64EndOfCentralDirectoryLocator zip64Locator;
-			Zip64EndOfCentralDirectory zip64EndOfCentralDirectory;
+			long avail = _source->fill(1);
+			if (!_trailing)
+				avail = (long)std::min((uint64_t)avail, _compressedSize - _consumed);
+			if (avail == 0)
+				return -1;
+			_zlibStream.next_in = (Bytef*)_source->data();
+			_zlibStream.avail_in = (uInt)std::min(avail, (long)BLOCKSIZE);
+			uInt before = _zlibStream.avail_in;
+			uLong outBefore = _zlibStream.total_out;
+			int err = ::inflate(&_zlibStream, Z_SYNC_FLUSH);
+			_source->consume(before - _zlibStream.avail_in);
+			_consumed += before - _zlibStream.avail_in;
+			cbReaded += _zlibStream.total_out - outBefore;
+			if (err == Z_STREAM_END)
+			{
+				_ended = true;
+				break;
+			}
+			if (err != Z_OK && err != Z_BUF_ERROR)
+				return -1;
+		}
+		return cbReaded;
+	}
 
-			_srcInput->seek(pos - 20);
-			if (!zip64Locator.parse(_srcInput.get()))
-				return false;
-			_srcInput->seek(zip64Locator.relativeOffsetOfCentralDirectory);
-			if (!zip64EndOfCentralDirectory.parse(_srcInput.get()))
+	//
+	// past the data: take the descriptor when the sizes trail, then check
+	// what was read against them
+	//
+	bool _finish()
+	{
+		_finished = true;
+		if (_range != NULL)
+			_consumed = _range->position();
+		if (!_trailing)
+		{
+			//
+			// whatever the decoder left behind its end
+			//
+			if (_consumed > _compressedSize || !_source->skip(_compressedSize - _consumed))
 				return false;
+			_consumed = _compressedSize;
+		}
+		else if (!_readDescriptor())
+			return false;
+		return (_crc == _header.crc32 &&
+			_position == _uncompressedSize &&
+			_consumed == _compressedSize);
+	}
+
+	//
+	// the signature is optional, sizes are 64-bit after a Zip64 local
+	// header, as ZipWritter streams them; writers that leave the extra
+	// out are told apart by matching what was read
+	//
+	bool _readDescriptor()
+	{
+		long avail = _source->fill(sizeof(Zip64DataDescriptor));
+		const byte* p = _source->data();
+		long at = (avail >= 4 && _load32(p) == 0x08074B50) ? 4 : 0;
+		if (avail < at + 12)
+			return false;
+		_header.crc32 = _load32(p + at);
+		bool narrow = !_zip64 &&
+			_consumed < 0xFFFFFFFF && _position < 0xFFFFFFFF &&
+			_load32(p + at + 4) == _consumed && _load32(p + at + 8) == _position;
+		if (narrow)
+		{
+			_compressedSize = _load32(p + at + 4);
+			_uncompressedSize = _load32(p + at + 8);
+			_source->consume(at + 12);
+			return true;
+		}
+		if (avail < at + 20)
+			return false;
+		_compressedSize = _load64(p + at + 4);
+		_uncompressedSize = _load64(p + at + 12);
+		_source->consume(at + 20);
+		return true;
+	}
+
+	StrongPtr<ZipStreamSource> _source;
+	StrongPtr<ZipStreamRange> _range;
+	StrongPtr<DataInput> _decoder;
+	LocalFileHeader _header;
+	z_stream _zlibStream;
+	uint64_t _compressedSize;
+	uint64_t _uncompressedSize;
+	uint64_t _position;
+	uint64_t _consumed;
+	uint32_t _crc;
+	bool _zip64;
+	bool _trailing;
+	bool _ended;
+	bool _finished;
+	bool _failed;
+};
+
+class ZipStreamReaderImpl
+	: public ZipStreamReader
+{
+public:
+	ZipStreamReaderImpl(DataInput* input)
+	{
+		_source = new ZipStreamSource(input);
+		_broken = false;
+	}
 
-			totalEntries = zip64EndOfCentralDirectory.totalEntries;
-			startOfCentralDirectory = zip64EndOfCentralDirectory.startOfCentralDirectory;
+	~ZipStreamReaderImpl()
+	{
+		_current.clear();
+		_source.clear();
+	}
 
+public:
+	StrongPtr<DataInput> next(wstr& name)
+	{
+		if (_current != NULL)
+		{
+			_broken = !_current->drain();
+			_current.clear();
 		}
-		else
+		if (_broken)
+			return NULL;
+
+		LocalFileHeader header;
+		if (_source->fill(sizeof(header)) < (long)sizeof(header))
+			return NULL;
+		::memcpy(&header, _source->data(), sizeof(header));
+		if (header.signature != 0x04034B50)
+			return NULL;
+		long cb = sizeof(header) + header.fileNameLength + header.extraFieldLength;
+		if (_source->fill(cb) < cb)
 		{
-			totalEntries = _endOfCentralDirectory.totalEntries;
-			startOfCentralDirectory = _endOfCentralDirectory.startOfCentralDirectory;
+			_broken = true;
+			return NULL;
 		}
+		const byte* p = _source->data() + sizeof(header);
+		str path((const char*)p, header.fileNameLength);
 
-		_srcInput->seek(_srcOffset + startOfCentralDirectory);
-		for (uint16_t i = 0; i < totalEntries; i++)
+		//
+		// a Zip64 extra in a local header carries both sizes
+		//
+		uint64_t compressedSize = header.compressedSize;
+		uint64_t uncompressedSize = header.uncompressedSize;
+		bool zip64 = false;
+		const byte* extra = p + header.fileNameLength;
+		const byte* end = extra + header.extraFieldLength;
+		while (extra + 4 <= end)
 		{
-			CentralDirectoryFileHeader header;
-			if (!header.parse(_srcInput.get()))
-				continue;
-			ByteArray name(header.fileNameLength);
-			if (!ReadData(_srcInput.get(), &name[0], name.size()))
-				continue;
-			_srcInput->skip(header.extraFieldLength);
-			_srcInput->skip(header.fileCommentLength);
-			CentralDirectoryFileHeader* fileHeader = new CentralDirectoryFileHeader();
-			*fileHeader = header;
-			_fileHeaders.insert(std::make_pair(str(name.begin(), name.end()), fileHeader));
+			uint16_t tag = extra[0] | (extra[1] << 8);
+			uint16_t size = extra[2] | (extra[3] << 8);
+			if (tag == 0x0001 && size >= 16 && extra + 4 + size <= end)
+			{
+				uncompressedSize = _load64(extra + 4);
+				compressedSize = _load64(extra + 12);
+				zip64 = true;
+			}
+			extra += 4 + size;
 		}
-		_vaild = 1;
-		return true;
+		_source->consume(cb);
+
+		_current = new ZipStreamItem(_source.get(), header, compressedSize, uncompressedSize, zip64);
+		name = s2ws(path);
+		return _current.get();
+	}
+
+	bool good()
+	{
+		return !_broken;
 	}
 
 private:
-	int _vaild;
-	int _srcOffset;
-	EndOfCentralDirectory _endOfCentralDirectory;
-	FileHeaders _fileHeaders;
-	StrongPtr<DataInput> _srcInput;
-	wstr _fileName;
+	StrongPtr<ZipStreamSource> _source;
+	StrongPtr<ZipStreamItem> _current;
+	bool _broken;
 };
 
 StrongPtr<ZipReader> ZipReader::open(const wstr &name)
@@ -675,6 +4174,11 @@ StrongPtr<ZipReader> ZipReader::open(const wstr &name)
 	return new ZipReaderImpl(name);
 }
 
+StrongPtr<ZipReader> ZipReader::open(const wstr& name, bool mapped)
+{
+	return new ZipReaderImpl(name, mapped);
+}
+
 StrongPtr<ZipReader> ZipReader::open(DataInput* input)
 {
 	if (!input || !input->seekable())
@@ -682,14 +4186,45 @@ StrongPtr<ZipReader> ZipReader::open(DataInput* input)
 	return new ZipReaderImpl(input);
 }
 
+bool ZipReader::buildIndex(const wstr& name)
+{
+	StrongPtr<ZipReaderImpl> reader = new ZipReaderImpl(name);
+	return reader->writeIndex();
+}
+
+StrongPtr<ZipStreamReader> ZipStreamReader::open(DataInput* input)
+{
+	if (!input)
+		return NULL;
+	return new ZipStreamReaderImpl(input);
+}
+
 StrongPtr<ZipWritter> ZipWritter::create(const wstr &name)
 {
 	return new ZipWritterImpl(name);
 }
 
+StrongPtr<ZipWritter> ZipWritter::openForAppend(const wstr& name)
+{
+	StrongPtr<ZipWritterImpl> writter = new ZipWritterImpl(name);
+	uint64_t start = 0;
+	StrongPtr<DataOutput> output;
+	{
+		StrongPtr<ZipReaderImpl> reader = new ZipReaderImpl(name);
+		if (reader->headers(std::bind(&ZipWritterImpl::adopt, writter.get(),
+			std::placeholders::_1, std::placeholders::_2,
+			std::placeholders::_3, std::placeholders::_4), start))
+			output = OpenFileForWrite(name);
+	}
+	if (output == NULL)
+		return NULL;
+	writter->resume(output.get(), start);
+	return writter;
+}
+
 StrongPtr<ZipWritter> ZipWritter::create(DataOutput* output)
 {
-	if (!output || !output->seekable())
+	if (!output)
 		return NULL;
 	return new ZipWritterImpl(output);
 }
@@ -2,6 +2,49 @@
 #define BPSLAB_ZIP_H
 
 #include <io.h>
+#include <vector>
+#include <functional>
+
+struct ZipCacheStats
+{
+	long hits;
+	long misses;
+	long evictions;
+	long entries;
+	long bytes;
+};
+
+struct ZipWritterStats
+{
+	long storedEntries;
+	long storedBytes;
+	long deflatedEntries;
+	long deflatedBytes;
+	long deflatedOutput;
+	long codecEntries;
+	long codecBytes;
+	long codecOutput;
+	long copiedEntries;
+	long copiedBytes;
+};
+
+//
+// an entry as it lies in its archive, still compressed, with what has
+// to go along when it is carried over to another one verbatim; offset
+// is that of its local header
+//
+struct ZipRawEntry
+{
+	int method;
+	uint16_t flags;
+	uint16_t versionNeeded;
+	uint32_t modified;
+	uint32_t crc32;
+	uint32_t attributes;
+	uint64_t compressedSize;
+	uint64_t uncompressedSize;
+	uint64_t offset;
+};
 
 class ZipReader
 	: public Refable
@@ -11,21 +54,252 @@ public:
 	virtual bool good() = 0;
 	virtual bool exist(const wstr& name) = 0;
 	virtual StrongPtr<DataInput> item(const wstr& name) = 0;
+	//
+	// the whole entry in one go, for small entries read entire: one
+	// positional read and a single inflate call. Returns the entry size,
+	// -1 if it is missing, unreadable or larger than size
+	//
+	virtual long readAll(const wstr& name, byte* buffer, long size) = 0;
+	virtual bool readAll(const wstr& name, std::vector<byte>& data) = 0;
+	//
+	// the compressed bytes of the entry as they are, nothing inflated or
+	// checked; NULL if it is missing or its local header is unreadable
+	//
+	virtual StrongPtr<DataInput> rawItem(const wstr& name, ZipRawEntry& entry) = 0;
+	virtual long count() = 0;
+	//
+	// bytes held by the in-memory entry index
+	//
+	virtual long footprint() = 0;
+	//
+	// unpacks every entry below targetDir on a pool of threads (0 picks
+	// one per core), returns the number of entries written or -1 if the
+	// archive is unreadable; entries that fail are appended to failures
+	// and do not stop the others
+	//
+	virtual long extractAll(const wstr& targetDir, int threads = 0, std::vector<wstr>* failures = NULL) = 0;
+	//
+	// hands the named items to callback in the order they lie in the
+	// archive, reading neighbours in large sequential runs rather than
+	// one by one; names that are missing come first, with NULL, as do
+	// unreadable items in their place. Returns the number of items
+	// handed over, -1 if the archive is unreadable
+	//
+	typedef std::function<void(const wstr& name, DataInput* input)> ItemCallback;
+	virtual long readMany(const std::vector<wstr>& names, const ItemCallback& callback) = 0;
+	//
+	// every name starting with prefix, in byte order, until callback
+	// returns false; the number of names visited, -1 if the archive is
+	// unreadable
+	//
+	typedef std::function<bool(const wstr& name)> ListCallback;
+	virtual long list(const wstr& prefix, const ListCallback& callback) = 0;
+	//
+	// what lies directly below folder dir ("" for the top), files and
+	// folders alike, the latter also when only implied by the paths of
+	// their content; names are full paths, folders end with '/'. Costs
+	// a search per child rather than a walk over the subtree
+	//
+	typedef std::function<bool(const wstr& name, bool folder)> ChildCallback;
+	virtual long children(const wstr& dir, const ChildCallback& callback) = 0;
+	//
+	// items are seekable; deflated ones restart from the closest access
+	// point, which reads record about every span bytes of output when
+	// span is above zero (off by default), buildAccessPoints() records
+	// them for one entry up front
+	//
+	virtual void setAccessPointSpan(long span) = 0;
+	virtual bool buildAccessPoints(const wstr& name) = 0;
+	//
+	// keeps up to budget bytes of inflated entries in memory and serves
+	// hits from there, least recently used first out; 0 turns it off,
+	// which is the default
+	//
+	virtual void setCacheBudget(long budget) = 0;
+	virtual ZipCacheStats cacheStats() = 0;
+	//
+	// items check their content against the stored CRC once read to the
+	// end and fail that last read on a mismatch; items that were seeked
+	// around skip the check. On by default
+	//
+	virtual void setVerify(bool verify) = 0;
+	//
+	// deflated items of an archive that is not memory mapped read their
+	// compressed input window bytes ahead on a background thread while
+	// they inflate, so disk and cpu overlap; 0 reads on demand, which is
+	// the default. Set before items are opened
+	//
+	virtual void setReadAhead(long window) = 0;
 public:
+	//
+	// open(name) picks up a lookup index stored as name + ".idx" when it
+	// matches the archive, and then does not walk the central directory;
+	// mapped maps the archive into memory instead of reading it, which
+	// stored items are then handed out of without a copy
+	//
 	static StrongPtr<ZipReader> open(const wstr& name);
+	static StrongPtr<ZipReader> open(const wstr& name, bool mapped);
+	//
+	// input has to be seekable, ZipStreamReader walks the others
+	//
 	static StrongPtr<ZipReader> open(DataInput* input);
+	static bool buildIndex(const wstr& name);
+};
+
+//
+// walks the local headers of an archive front to back while it arrives,
+// without the central directory, so pipes and sockets will do; entries
+// whose sizes trail their data in a descriptor are found by decoding
+// them, stored ones by scanning for the descriptor
+//
+class ZipStreamReader
+	: public Refable
+{
+public:
+	virtual ~ZipStreamReader() {}
+	//
+	// next entry in archive order and its name, NULL at the central
+	// directory or when the input breaks off. What is left of the
+	// previous entry is skipped first, its input reads nothing after
+	// that. Items are not seekable and fail their last read on a CRC
+	// mismatch
+	//
+	virtual StrongPtr<DataInput> next(wstr& name) = 0;
+	//
+	// false once the walk stopped on broken input rather than at the
+	// central directory
+	//
+	virtual bool good() = 0;
+public:
+	static StrongPtr<ZipStreamReader> open(DataInput* input);
 };
 
 class ZipWritter
 	: public Refable
 {
+public:
+	enum
+	{
+		methodStored = 0,
+		methodDeflated = 8,
+		//
+		// trial compresses the first 64K of the entry and stores it
+		// unless that saves at least a tenth
+		//
+		methodAuto = -1,
+		//
+		// private LZ block codec decoding at memory speed, for archives
+		// that are only read back by this reader
+		//
+		methodLz = 0x4C5A
+	};
+	enum
+	{
+		//
+		// starts at level 6 and moves a step down whenever deflate falls
+		// behind targetRate, a step up when it runs well ahead of it
+		//
+		levelAuto = -2
+	};
+	//
+	// deflate parameters of one item as taken by zlib's deflateInit2(),
+	// windowBits counted positive; targetRate is in bytes per second and
+	// only used with levelAuto
+	//
+	struct ItemOptions
+	{
+		int method;
+		int level;
+		int memLevel;
+		int windowBits;
+		int strategy;
+		long targetRate;
+
+		ItemOptions(int itemMethod = methodDeflated)
+		{
+			method = itemMethod;
+			level = -1;
+			memLevel = 9;
+			windowBits = 15;
+			strategy = 0;
+			targetRate = 0;
+		}
+	};
 public:
 	virtual ~ZipWritter() {}
-	virtual WeakPtr<DataOutput> addItem(const wstr& name) = 0;
+	WeakPtr<DataOutput> addItem(const wstr& name, int method = methodDeflated)
+	{
+		return addItem(name, ItemOptions(method));
+	}
+	//
+	// NULL when the options are out of range
+	//
+	virtual WeakPtr<DataOutput> addItem(const wstr& name, const ItemOptions& options) = 0;
+	//
+	// takes the named entry of reader over without recompressing it: the
+	// compressed bytes are copied and CRC, sizes, method and time go into
+	// the new headers unchanged. False if it is missing there, already
+	// present here or cannot be read whole. The bulk form copies in the
+	// order the entries lie in reader and returns how many it copied
+	//
+	virtual bool copyRaw(ZipReader* reader, const wstr& name) = 0;
+	virtual long copyRaw(ZipReader* reader, const std::vector<wstr>& names) = 0;
 	virtual void flush() = 0;
+	//
+	// false once part of the archive could not be written; flush() then
+	// leaves out the end of central directory record, so that the broken
+	// archive does not pass for a whole one
+	//
+	virtual bool good() = 0;
+	//
+	// entries and uncompressed bytes that went to each method so far,
+	// deflatedOutput is what the deflated ones came to; codec counts
+	// the methods served through Codec
+	//
+	virtual ZipWritterStats stats() = 0;
+	//
+	// deflates each entry on threads cores (0 picks one per core) in 128K
+	// blocks joined by sync flushes, still one plain deflate stream; 1
+	// keeps the serial path, which is the default
+	//
+	virtual void setThreads(int threads) = 0;
+	//
+	// lets addItem() be called from any number of threads with items open
+	// side by side, set before the first one; each item is compressed on
+	// its own and appended whole by a serializer thread once it is
+	// flushed, flush() of the writter finishes those still open
+	//
+	virtual void setConcurrent(bool concurrent) = 0;
+	//
+	// also write the lookup index next to the archive on flush(), only
+	// for writters created by name
+	//
+	virtual void setIndexed(bool indexed) = 0;
+	//
+	// never seeks the output: local headers go out with general purpose
+	// bit 3 and zero sizes, and a data descriptor follows each entry's
+	// data. On by itself for outputs that are not seekable (pipes,
+	// sockets); set before the first addItem()
+	//
+	virtual void setStreaming(bool streaming) = 0;
+	//
+	// keeps the central directory records in a temp file once they pass
+	// 8M instead of in memory, for archives of millions of entries. This
+	// does not bound the writer's memory: every name still stays in it
+	// for the duplicate checks, at its length plus 18 to 34 bytes
+	//
+	virtual void setSpilling(bool spilling) = 0;
 public:
 	static StrongPtr<ZipWritter> create(const wstr& name);
 	static StrongPtr<ZipWritter> create(DataOutput* output);
+	//
+	// adds to an existing archive in place: new entries overwrite its
+	// central directory and flush() writes the old and new ones after
+	// them. Extra fields of the old entries are kept, entry and archive
+	// comments are not carried over; NULL when the archive cannot be
+	// read whole
+	//
+	static StrongPtr<ZipWritter> openForAppend(const wstr& name);
 };
 
 #endif // BPSLAB_ZIP_H
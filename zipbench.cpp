@@ -0,0 +1,385 @@
+#include <zip.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <locale.h>
+#include <vector>
+#include <string>
+#include <thread>
+#include <chrono>
+#include <random>
+#include <algorithm>
+
+typedef std::chrono::steady_clock Clock;
+
+//
+// corpus and run settings, all of them --name=value on the command line
+//
+struct BenchOptions
+{
+	long entries;
+	long size;
+	long maxSize;
+	std::string distribution;
+	double compressibility;
+	long ops;
+	long opens;
+	int method;
+	std::string path;
+
+	BenchOptions()
+	{
+		entries = 10000;
+		size = 4096;
+		maxSize = 65536;
+		distribution = "fixed";
+		compressibility = 0.5;
+		ops = 20000;
+		opens = 20;
+		method = ZipWritter::methodDeflated;
+		path = "/tmp/bpslab_zip_bench.zip";
+	}
+
+	bool parse(int argc, char *argv[])
+	{
+		for (int i = 1; i < argc; i++)
+		{
+			const char* arg = argv[i];
+			const char* value = strchr(arg, '=');
+			if (strncmp(arg, "--", 2) != 0 || !value)
+				return false;
+			std::string key(arg + 2, value++);
+			if (key == "entries")
+				entries = atol(value);
+			else if (key == "size")
+				size = atol(value);
+			else if (key == "max-size")
+				maxSize = atol(value);
+			else if (key == "distribution")
+				distribution = value;
+			else if (key == "compressibility")
+				compressibility = atof(value);
+			else if (key == "ops")
+				ops = atol(value);
+			else if (key == "opens")
+				opens = atol(value);
+			else if (key == "method")
+				method = atoi(value);
+			else if (key == "path")
+				path = value;
+			else
+				return false;
+		}
+		return entries > 0 && size >= 0 && ops > 0 && opens > 0 &&
+			(distribution == "fixed" || distribution == "uniform" || distribution == "lognormal");
+	}
+};
+
+//
+// p50/p99 and friends of one measurement, in the unit it was taken in
+//
+struct BenchSamples
+{
+	std::vector<double> values;
+
+	void add(double value)
+	{
+		values.push_back(value);
+	}
+
+	double percentile(double p)
+	{
+		if (values.empty())
+			return 0;
+		std::sort(values.begin(), values.end());
+		size_t i = std::min(values.size() - 1, (size_t)(p / 100 * values.size()));
+		return values[i];
+	}
+
+	void print(const char* name, const char* unit, bool last = false)
+	{
+		printf("\t\t\"%s\": {\"unit\": \"%s\", \"count\": %zu, \"p50\": %.3f, \"p99\": %.3f, \"max\": %.3f}%s\n",
+			name, unit, values.size(), percentile(50), percentile(99), percentile(100), last ? "" : ",");
+	}
+};
+
+static double _since(Clock::time_point start)
+{
+	return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+static wstr _entryName(long i)
+{
+	wchar name[64];
+	swprintf(name, 64, L"bench/%03ld/%08ld.dat", i % 256, i);
+	return name;
+}
+
+static long _entrySize(const BenchOptions& options, std::mt19937& random)
+{
+	if (options.distribution == "uniform")
+		return std::uniform_int_distribution<long>(options.size, std::max(options.size, options.maxSize))(random);
+	if (options.distribution == "lognormal")
+	{
+		//
+		// median at size, a long tail capped at max-size
+		//
+		double size = std::lognormal_distribution<double>(log((double)std::max(options.size, 1L)), 1.0)(random);
+		return std::min((long)size, options.maxSize);
+	}
+	return options.size;
+}
+
+//
+// words from a small vocabulary for the compressible share of each 64
+// byte chunk, random bytes for the rest
+//
+static void _fillEntry(byte* data, long size, double compressibility, std::mt19937& random)
+{
+	static const char* words[] = {
+		"zip", "entry", "central", "directory", "deflate", "stored", "offset", "header",
+		"reader", "writer", "cache", "index", "block", "stream", "archive", "folder",
+	};
+	std::uniform_real_distribution<double> coin(0, 1);
+	for (long j = 0; j < size; )
+	{
+		long end = std::min(size, j + 64);
+		if (coin(random) < compressibility)
+		{
+			while (j < end)
+			{
+				const char* word = words[random() % 16];
+				while (*word && j < end)
+					data[j++] = *word++;
+				if (j < end)
+					data[j++] = random() % 8 ? ' ' : '\n';
+			}
+		}
+		else
+		{
+			while (j < end)
+				data[j++] = (byte)random();
+		}
+	}
+}
+
+//
+// writes the corpus, the same one for a given set of options, and
+// times each entry from addItem() until the next one starts
+//
+static bool _createArchive(const BenchOptions& options, const wstr& path, int method, BenchSamples* latency, double* seconds, long* bytes)
+{
+	std::mt19937 random(1);
+	std::vector<byte> data;
+	*bytes = 0;
+	Clock::time_point start = Clock::now();
+	StrongPtr<ZipWritter> writter = ZipWritter::create(path);
+	for (long i = 0; i < options.entries; i++)
+	{
+		long size = _entrySize(options, random);
+		data.resize(std::max(size, 1L));
+		_fillEntry(&data[0], size, options.compressibility, random);
+		Clock::time_point begin = Clock::now();
+		StrongPtr<DataOutput> output = writter->addItem(_entryName(i), method).promote();
+		if (!output || output->write(&data[0], size) != size)
+			return false;
+		if (latency)
+			latency->add(_since(begin) * 1e6);
+		*bytes += size;
+	}
+	writter->flush();
+	*seconds = _since(start);
+
+	//
+	// nothing is measured on an archive that did not make it out whole
+	//
+	if (!writter->good())
+		return false;
+	StrongPtr<ZipReader> reader = ZipReader::open(path);
+	return reader->good() && reader->exist(_entryName(options.entries - 1));
+}
+
+static long _readItem(ZipReader* reader, const wstr& name, byte* buffer, long size)
+{
+	StrongPtr<DataInput> input = reader->item(name);
+	if (!input)
+		return -1;
+	long total = 0;
+	long cb;
+	while ((cb = input->read(buffer, size)) > 0)
+		total += cb;
+	return cb < 0 ? -1 : total;
+}
+
+static void _worker(ZipReader* reader, long entries, long ops, unsigned seed, long* bytes)
+{
+	byte buffer[16384];
+	long total = 0;
+	for (long i = 0; i < ops; i++)
+	{
+		seed = seed * 1103515245 + 12345;
+		long cb = _readItem(reader, _entryName((seed >> 8) % entries), buffer, sizeof(buffer));
+		if (cb > 0)
+			total += cb;
+	}
+	*bytes = total;
+}
+
+static long _fileSize(const wstr& path)
+{
+	StrongPtr<DataInput> file = OpenFile(path);
+	return file != NULL ? file->size() : -1;
+}
+
+static void _benchCodecs(const BenchOptions& options)
+{
+	static const struct { const char* name; int method; } codecs[] = {
+		{ "deflate", ZipWritter::methodDeflated },
+		{ "lz", ZipWritter::methodLz },
+		{ "stored", ZipWritter::methodStored },
+	};
+	wstr path = s2ws(options.path + ".codec");
+	printf("\t\"codecs\": {\n");
+	for (size_t c = 0; c < sizeof(codecs) / sizeof(codecs[0]); c++)
+	{
+		double writeSeconds = 0;
+		long raw = 0;
+		if (!_createArchive(options, path, codecs[c].method, NULL, &writeSeconds, &raw))
+			continue;
+		StrongPtr<ZipReader> reader = ZipReader::open(path);
+		long total = 0;
+		Clock::time_point start = Clock::now();
+		_worker(reader.get(), options.entries, options.entries, 1, &total);
+		double readSeconds = _since(start);
+		printf("\t\t\"%s\": {\"write_mbps\": %.1f, \"ratio\": %.3f, \"read_mbps\": %.1f}%s\n", codecs[c].name,
+			raw / writeSeconds / 1048576, (double)_fileSize(path) / std::max(raw, 1L),
+			total / readSeconds / 1048576, c + 1 < sizeof(codecs) / sizeof(codecs[0]) ? "," : "");
+	}
+	printf("\t},\n");
+	RemoveFile(path);
+}
+
+static void _benchThreads(ZipReader* reader, const BenchOptions& options)
+{
+	printf("\t\"threads\": [\n");
+	for (int threads = 1; threads <= 64; threads *= 2)
+	{
+		std::vector<std::thread> workers;
+		std::vector<long> bytes(threads);
+		Clock::time_point start = Clock::now();
+		for (int i = 0; i < threads; i++)
+			workers.push_back(std::thread(_worker, reader, options.entries, options.ops / threads, i + 1, &bytes[i]));
+		long total = 0;
+		for (int i = 0; i < threads; i++)
+		{
+			workers[i].join();
+			total += bytes[i];
+		}
+		double seconds = _since(start);
+		printf("\t\t{\"threads\": %d, \"items_per_s\": %.0f, \"mbps\": %.1f}%s\n", threads,
+			(options.ops / threads) * threads / seconds, total / seconds / 1048576, threads < 64 ? "," : "");
+	}
+	printf("\t]\n");
+}
+
+//
+// one JSON object on stdout; latencies are per call, rates over the
+// whole pass
+//
+int main(int argc, char *argv[])
+{
+	setlocale(LC_ALL, "");
+	BenchOptions options;
+	if (!options.parse(argc, argv))
+	{
+		fprintf(stderr, "usage: %s [--entries=N] [--size=N] [--max-size=N] "
+			"[--distribution=fixed|uniform|lognormal] [--compressibility=0..1] "
+			"[--ops=N] [--opens=N] [--method=N] [--path=file]\n", argv[0]);
+		return 2;
+	}
+	wstr path = s2ws(options.path);
+
+	BenchSamples writeLatency;
+	double writeSeconds = 0;
+	long raw = 0;
+	if (!_createArchive(options, path, options.method, &writeLatency, &writeSeconds, &raw))
+	{
+		fprintf(stderr, "cannot create %ls\n", path.c_str());
+		return 1;
+	}
+
+	//
+	// open parses the central directory, count() makes sure of it
+	//
+	BenchSamples openLatency;
+	StrongPtr<ZipReader> reader;
+	for (long i = 0; i < options.opens; i++)
+	{
+		Clock::time_point start = Clock::now();
+		reader = ZipReader::open(path);
+		if (!reader->good() || reader->count() <= 0)
+		{
+			fprintf(stderr, "cannot open %ls\n", path.c_str());
+			return 1;
+		}
+		openLatency.add(_since(start) * 1e3);
+	}
+
+	//
+	// lookups alternate between names that exist and names that do not
+	//
+	BenchSamples existLatency;
+	std::mt19937 random(2);
+	Clock::time_point start = Clock::now();
+	for (long i = 0; i < options.ops; i++)
+	{
+		long n = random() % options.entries;
+		wstr name = (i & 1) ? _entryName(n + options.entries) : _entryName(n);
+		Clock::time_point begin = Clock::now();
+		reader->exist(name);
+		existLatency.add(_since(begin) * 1e9);
+	}
+	double existSeconds = _since(start);
+
+	BenchSamples itemLatency;
+	BenchSamples readLatency;
+	std::vector<byte> buffer(65536);
+	long total = 0;
+	double inflateSeconds = 0;
+	for (long i = 0; i < options.ops; i++)
+	{
+		wstr name = _entryName(random() % options.entries);
+		Clock::time_point begin = Clock::now();
+		StrongPtr<DataInput> input = reader->item(name);
+		itemLatency.add(_since(begin) * 1e6);
+		if (!input)
+			continue;
+		long cb;
+		while ((cb = input->read(&buffer[0], buffer.size())) > 0)
+			total += cb;
+		double seconds = _since(begin);
+		inflateSeconds += seconds;
+		readLatency.add(seconds * 1e6);
+	}
+
+	printf("{\n\t\"config\": {\"entries\": %ld, \"size\": %ld, \"max_size\": %ld, \"distribution\": \"%s\", "
+		"\"compressibility\": %.2f, \"ops\": %ld, \"method\": %d},\n",
+		options.entries, options.size, options.maxSize, options.distribution.c_str(),
+		options.compressibility, options.ops, options.method);
+	printf("\t\"archive\": {\"bytes\": %ld, \"raw_bytes\": %ld, \"index_bytes_per_entry\": %.1f},\n",
+		_fileSize(path), raw, (double)reader->footprint() / reader->count());
+	printf("\t\"rates\": {\"write_mbps\": %.1f, \"exist_per_s\": %.0f, \"inflate_mbps\": %.1f},\n",
+		raw / writeSeconds / 1048576, options.ops / existSeconds, total / inflateSeconds / 1048576);
+	printf("\t\"latency\": {\n");
+	openLatency.print("open", "ms");
+	writeLatency.print("write_entry", "us");
+	existLatency.print("exist", "ns");
+	itemLatency.print("item", "us");
+	readLatency.print("read_entry", "us", true);
+	printf("\t},\n");
+	_benchCodecs(options);
+	_benchThreads(reader.get(), options);
+	printf("}\n");
+	return 0;
+}